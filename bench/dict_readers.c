@@ -0,0 +1,123 @@
+// Read scalability of a shared registry-style dictionary: N threads look up
+// keys while one writer keeps replacing values. Compares the lock-free
+// concurrent mode against a plain dictionary behind a pthread rwlock.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#define KEYS 256
+#define DURATION_MS 500
+
+static CFMutableDictionaryRef Dict;
+static CFStringRef Keys[KEYS];
+static pthread_rwlock_t Lock = PTHREAD_RWLOCK_INITIALIZER;
+static Boolean UseLock;
+static _Atomic int Stop;
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* Reader(void *arg)
+{
+    uint64_t ops = 0;
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    while(!__c11_atomic_load(&Stop, __ATOMIC_RELAXED))
+    {
+        for(int i = 0; i < 64; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            CFStringRef key = Keys[(seed >> 8) % KEYS];
+            if(UseLock)
+            {
+                pthread_rwlock_rdlock(&Lock);
+                CFDictionaryGetValue(Dict, key);
+                pthread_rwlock_unlock(&Lock);
+            }
+            else
+            {
+                CFDictionaryGetValue(Dict, key);
+            }
+        }
+        ops += 64;
+    }
+    return (void*)(uintptr_t)ops;
+}
+
+static void* Writer(void *arg)
+{
+    int n = 0;
+    while(!__c11_atomic_load(&Stop, __ATOMIC_RELAXED))
+    {
+        CFNumberRef value = CFNumberCreate(NULL, kCFNumberIntType, &n);
+        if(UseLock)
+            pthread_rwlock_wrlock(&Lock);
+        CFDictionarySetValue(Dict, Keys[n % KEYS], value);
+        if(UseLock)
+            pthread_rwlock_unlock(&Lock);
+        CFRelease(value);
+        ++n;
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static double Run(int threads)
+{
+    pthread_t readers[64], writer;
+    __c11_atomic_store(&Stop, 0, __ATOMIC_RELAXED);
+    pthread_create(&writer, NULL, Writer, NULL);
+    for(int i = 0; i < threads; ++i)
+        pthread_create(&readers[i], NULL, Reader, (void*)(uintptr_t)i);
+    double start = Now();
+    struct timespec ts = { DURATION_MS / 1000, (DURATION_MS % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+    __c11_atomic_store(&Stop, 1, __ATOMIC_RELAXED);
+    uint64_t total = 0;
+    for(int i = 0; i < threads; ++i)
+    {
+        void *ops;
+        pthread_join(readers[i], &ops);
+        total += (uintptr_t)ops;
+    }
+    double elapsed = Now() - start;
+    pthread_join(writer, NULL);
+    return total / elapsed / 1e6;
+}
+
+int main(void)
+{
+    char name[32];
+    for(int i = 0; i < KEYS; ++i)
+    {
+        snprintf(name, sizeof(name), "IORegistryKey%d", i);
+        Keys[i] = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    }
+    printf("%8s %14s %14s\n", "readers", "rwlock Mops/s", "epoch Mops/s");
+    for(int threads = 1; threads <= 64; threads *= 2)
+    {
+        double result[2];
+        for(int mode = 0; mode < 2; ++mode)
+        {
+            Dict = CFDictionaryCreateMutable(NULL, KEYS, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            for(int i = 0; i < KEYS; ++i)
+                CFDictionarySetValue(Dict, Keys[i], Keys[i]);
+            UseLock = mode == 0;
+            if(!UseLock)
+                CFDictionaryMakeConcurrent(Dict);
+            result[mode] = Run(threads);
+            CFRelease(Dict);
+        }
+        printf("%8d %14.2f %14.2f\n", threads, result[0], result[1]);
+    }
+    for(int i = 0; i < KEYS; ++i)
+        CFRelease(Keys[i]);
+    return 0;
+}
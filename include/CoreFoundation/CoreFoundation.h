@@ -15,6 +15,7 @@ typedef uint32_t CFOptionFlags;
 typedef size_t CFIndex;
 typedef CFIndex CFRange[2];
 typedef double CFAbsoluteTime;
+typedef unsigned long CFHashCode;
 
 #ifndef FALSE
 #   define FALSE false
@@ -42,6 +43,7 @@ typedef enum
     kCFTypeArray,
     kCFTypeSet,
     kCFTypeDictionary,
+    kCFTypeAllocator,
 } CFTypeID;
 
 typedef enum
@@ -68,6 +70,13 @@ typedef enum
     kCFNumberDoubleType,
 } CFNumberType;
 
+typedef enum
+{
+    kCFCompareLessThan = -1,
+    kCFCompareEqualTo = 0,
+    kCFCompareGreaterThan = 1,
+} CFComparisonResult;
+
 #define CFNullGetTypeID()       kCFTypeNull
 #define CFBooleanGetTypeID()    kCFTypeBoolean
 #define CFStringGetTypeID()     kCFTypeString
@@ -77,12 +86,14 @@ typedef enum
 #define CFArrayGetTypeID()      kCFTypeArray
 #define CFSetGetTypeID()        kCFTypeSet
 #define CFDictionaryGetTypeID() kCFTypeDictionary
+#define CFAllocatorGetTypeID()  kCFTypeAllocator
 
 struct CFCallbacks
 {
     const void* (*retain)(const void*);
     void (*release)(const void*);
     Boolean (*equal)(const void*, const void*);
+    CFHashCode (*hash)(const void*);
 };
 
 typedef const void* CFTypeRef;
@@ -104,6 +115,47 @@ typedef struct CFCallbacks CFSetCallBacks;
 typedef struct CFCallbacks CFDictionaryKeyCallBacks;
 typedef struct CFCallbacks CFDictionaryValueCallBacks;
 
+typedef const void* (*CFAllocatorRetainCallBack)(const void *info);
+typedef void (*CFAllocatorReleaseCallBack)(const void *info);
+typedef CFStringRef (*CFAllocatorCopyDescriptionCallBack)(const void *info);
+typedef void* (*CFAllocatorAllocateCallBack)(CFIndex allocSize, CFOptionFlags hint, void *info);
+typedef void* (*CFAllocatorReallocateCallBack)(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info);
+typedef void (*CFAllocatorDeallocateCallBack)(void *ptr, void *info);
+typedef CFIndex (*CFAllocatorPreferredSizeCallBack)(CFIndex size, CFOptionFlags hint, void *info);
+
+typedef struct
+{
+    CFIndex version;
+    void *info;
+    CFAllocatorRetainCallBack retain;
+    CFAllocatorReleaseCallBack release;
+    CFAllocatorCopyDescriptionCallBack copyDescription;
+    CFAllocatorAllocateCallBack allocate;
+    CFAllocatorReallocateCallBack reallocate;
+    CFAllocatorDeallocateCallBack deallocate;
+    CFAllocatorPreferredSizeCallBack preferredSize;
+} CFAllocatorContext;
+
+// Per size class counters of the header pools. Hits were served from the
+// calling thread's cache, slabs counts the pool's calls to malloc.
+typedef struct
+{
+    CFIndex size;
+    uint64_t allocations;
+    uint64_t hits;
+    uint64_t frees;
+    uint64_t slabs;
+} CFPoolStatistics;
+
+// Objects of one type and the bytes they take, split into their fixed-size headers
+// and the payload they own: string bytes, data buffers, element arrays, hash indexes.
+typedef struct
+{
+    int64_t objects;
+    int64_t headerBytes;
+    int64_t payloadBytes;
+} CFMemoryStatistics;
+
 extern const CFBooleanRef kCFBooleanTrue;
 extern const CFBooleanRef kCFBooleanFalse;
 
@@ -114,36 +166,42 @@ extern const struct CFCallbacks kCFTypeDictionaryValueCallBacks;
 
 struct CFBase
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
 };
 
-struct CFBoolean
-{
-    CFTypeID type;
-    _Atomic uint32_t refcnt;
-    bool value;
-};
-
+// Strings shorter than a pointer live in place of it (see CFStringCreateWithBytes),
+// longer ones point to bytes that usually follow the header. Either way NUL-terminated.
 struct CFString
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
-    const char *str;
+    union
+    {
+        const char *str;
+        char inlineBytes[sizeof(const char*)];
+    };
+    CFIndex length;
+    _Atomic CFHashCode hash;
 };
 
 struct CFData
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
     void *bytes;
     CFIndex length;
     CFIndex capacity;
+    _Atomic CFHashCode hash;
 };
 
 struct CFNumber
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
     CFNumberType numType;
     union
@@ -155,24 +213,52 @@ struct CFNumber
 
 struct CFDate
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
     double time;
 };
 
+// Open-addressing index over a container's elements array.
+// ctrl holds one byte per bucket (empty, deleted, or 7 bits of the hash),
+// slots hold the position of the element in the elements array.
+struct CFHashIndex
+{
+    uint32_t *slots;
+    uint8_t *ctrl;
+    CFIndex buckets;
+};
+
 struct CFArray
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
     const void **elements;
     CFIndex length;
     CFIndex capacity;
     const struct CFCallbacks *callbacks;
+    _Atomic uint64_t fingerprint;
+};
+
+// Same layout as struct CFArray, plus a hash index over the elements.
+struct CFSet
+{
+    uint16_t type;
+    uint16_t flags;
+    _Atomic uint32_t refcnt;
+    const void **elements;
+    CFIndex length;
+    CFIndex capacity;
+    const struct CFCallbacks *callbacks;
+    _Atomic uint64_t fingerprint;
+    struct CFHashIndex index;
 };
 
 struct CFDictionary
 {
-    CFTypeID type;
+    uint16_t type;
+    uint16_t flags;
     _Atomic uint32_t refcnt;
     struct
     {
@@ -181,30 +267,130 @@ struct CFDictionary
     } *elements;
     CFIndex length;
     CFIndex capacity;
+    CFIndex removed;
     const struct CFCallbacks *keyCallbacks;
     const struct CFCallbacks *valueCallbacks;
+    _Atomic uint64_t fingerprint;
+    struct CFDictionary *_Atomic snapshot;
+    struct CFHashIndex index;
+    struct CFHamtNode *root;
+};
+
+// Arena allocators hand out memory by bumping a cursor through chunks
+// (the first of which may be caller-provided) and free it all at once.
+struct CFArenaChunk;
+
+struct CFAllocator
+{
+    uint16_t type;
+    uint16_t flags;
+    _Atomic uint32_t refcnt;
+    CFAllocatorContext context;
+    struct CFArenaChunk *chunks;
+    uint8_t *buffer;
+    uint8_t *cursor;
+    uint8_t *end;
+    void *last;
+    CFIndex chunkSize;
 };
 
+// Booleans and small integers are encoded in the pointer itself: bit 0 is set,
+// bits 1-4 hold the type ID and the bits above that hold the value.
+// Numbers keep their CFNumberType in bits 5-8 and a signed integer above it.
+#define CF_IS_TAGGED_OBJ(cf)        ((uintptr_t)(cf) & 0x1)
+#define CF_TAGGED_OBJ_TYPE(cf)      ((CFTypeID)(((uintptr_t)(cf) >> 1) & 0xf))
+#define CF_TAGGED_BOOLEAN(v)        ((CFBooleanRef)(uintptr_t)(((v) ? 0x20 : 0) | (kCFTypeBoolean << 1) | 0x1))
+#define CF_TAGGED_BOOLEAN_VALUE(cf) ((Boolean)(((uintptr_t)(cf) >> 5) & 0x1))
+#define CF_TAGGED_NUMBER(type, v)   ((CFNumberRef)(((uintptr_t)(intptr_t)(v) << 9) | ((uintptr_t)(type) << 5) | (kCFTypeNumber << 1) | 0x1))
+#define CF_TAGGED_NUMBER_TYPE(cf)   ((CFNumberType)(((uintptr_t)(cf) >> 5) & 0xf))
+#define CF_TAGGED_NUMBER_VALUE(cf)  ((intptr_t)(cf) >> 9)
+
 #define CFSTR(s) \
 ({ \
-    static struct CFString ss = { kCFTypeString, 0xffffffff, s }; \
+    static struct CFString ss = { kCFTypeString, 0, 0xffffffff, { s }, sizeof(s) - 1 }; \
     &ss; \
 })
 
+// Constant objects for static initializers, which nest into whole trees:
+//
+//     static const CFDictionaryRef kMatching = CF_CONST_DICTIONARY(
+//         CF_CONST_STRING("IOProviderClass"), CF_CONST_STRING("IOService"),
+//         CF_CONST_STRING("IOPropertyMatch"), CF_CONST_ARRAY(CF_CONST_NUMBER(1), CF_CONST_BOOLEAN(true)));
+//
+// They are immortal and take no allocations; element arrays are exactly sized and read-only.
+// Dictionaries take alternating keys and values and are searched linearly, like any small one.
+// Only use these at file scope: elsewhere, compound literals don't outlive the enclosing block.
+#define CF_CONST_COUNT(...) (sizeof((const void *const[]){ __VA_ARGS__ }) / sizeof(const void*))
+
+#define CF_CONST_STRING(s) \
+    ((CFStringRef)&(struct CFString){ .type = kCFTypeString, .refcnt = 0xffffffff, .str = s, .length = sizeof(s) - 1 })
+
+// Integers are tagged whenever they fit, same as CFNumberCreate does.
+#define CF_CONST_NUMBER(v) \
+    (CF_TAGGED_NUMBER_VALUE(CF_TAGGED_NUMBER(kCFNumberLongLongType, (long long)(v))) == (long long)(v) \
+        ? CF_TAGGED_NUMBER(kCFNumberLongLongType, (long long)(v)) \
+        : (CFNumberRef)&(struct CFNumber){ .type = kCFTypeNumber, .refcnt = 0xffffffff, .numType = kCFNumberLongLongType, .value.l = (unsigned long long)(long long)(v) })
+
+#define CF_CONST_DOUBLE(v) \
+    ((CFNumberRef)&(struct CFNumber){ .type = kCFTypeNumber, .refcnt = 0xffffffff, .numType = kCFNumberDoubleType, .value.d = (v) })
+
+#define CF_CONST_BOOLEAN(v) CF_TAGGED_BOOLEAN(v)
+
+#define CF_CONST_ARRAY(...) \
+    ((CFArrayRef)&(struct CFArray){ .type = kCFTypeArray, .refcnt = 0xffffffff, \
+        .elements = (const void**)(const void *const[]){ __VA_ARGS__ }, \
+        .length = CF_CONST_COUNT(__VA_ARGS__), .capacity = CF_CONST_COUNT(__VA_ARGS__), \
+        .callbacks = &kCFTypeArrayCallBacks })
+
+#define CF_CONST_DICTIONARY(...) \
+    ((CFDictionaryRef)&(struct CFDictionary){ .type = kCFTypeDictionary, .refcnt = 0xffffffff, \
+        .elements = (void*)(const void *const[]){ __VA_ARGS__ }, \
+        .length = CF_CONST_COUNT(__VA_ARGS__) / 2, .capacity = CF_CONST_COUNT(__VA_ARGS__) / 2, \
+        .keyCallbacks = &kCFTypeDictionaryKeyCallBacks, .valueCallbacks = &kCFTypeDictionaryValueCallBacks })
+
 #define CFRangeMake(min, max) ((CFRange){ min, max })
 
-#define kCFAllocatorNull NULL
 #define kCFAllocatorDefault NULL
 
+extern const CFAllocatorRef kCFAllocatorNull;
+
+typedef CFComparisonResult (*CFComparatorFunction)(const void *val1, const void *val2, void *context);
 typedef void (*CFArrayApplierFunction)(const void *value, void *context);
 typedef void (*CFSetApplierFunction)(const void *value, void *context);
 typedef void (*CFDictionaryApplierFunction)(const void *key, const void *value, void *context);
 
+CFAllocatorRef CFAllocatorCreate(CFAllocatorRef allocator, CFAllocatorContext *context);
+CFAllocatorRef CFAllocatorCreateArena(CFAllocatorRef allocator, void *buffer, CFIndex size);
+void* CFAllocatorAllocate(CFAllocatorRef allocator, CFIndex size, CFOptionFlags hint);
+void* CFAllocatorReallocate(CFAllocatorRef allocator, void *ptr, CFIndex newsize, CFOptionFlags hint);
+void CFAllocatorDeallocate(CFAllocatorRef allocator, void *ptr);
+void CFAllocatorGetContext(CFAllocatorRef allocator, CFAllocatorContext *context);
+CFIndex CFPoolGetStatistics(CFPoolStatistics *stats, CFIndex count);
+// Both fill in `stats` indexed by CFTypeID. Live counts are only kept when built
+// with CF_MEMORY_ACCOUNTING, otherwise CFMemoryGetStatistics returns 0.
+CFIndex CFMemoryGetStatistics(CFMemoryStatistics *stats, CFIndex count);
+CFIndex CFMemoryMeasure(CFTypeRef cf, CFMemoryStatistics *stats, CFIndex count);
+
 CFTypeID CFGetTypeID(CFTypeRef cf);
+CFAllocatorRef CFGetAllocator(CFTypeRef cf);
 CFTypeRef CFRetain(CFTypeRef cf);
 void CFRelease(CFTypeRef cf);
+void CFSetThreadPrivateRefcounts(Boolean enabled);
+void CFPublish(CFTypeRef cf);
+uint64_t CFRefcountGetContentionCount(void);
+// Frees dead containers on a background thread; disabling waits for the queue to drain.
+// Containers with private refcounts that were never published are still freed inline.
+Boolean CFSetBackgroundReclamation(Boolean enabled);
+
+void CFEpochEnter(void);
+void CFEpochExit(void);
+
+CFTypeRef CFFreeze(CFTypeRef cf);
+void CFFrozenRelease(CFTypeRef frozen);
 
 Boolean CFEqual(CFTypeRef cf1, CFTypeRef cf2);
+CFHashCode CFHash(CFTypeRef cf);
+uint64_t CFFingerprint(CFTypeRef cf);
 
 Boolean CFBooleanGetValue(CFBooleanRef boolean);
 
@@ -212,20 +398,31 @@ CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CF
 CFStringRef CFStringCreateWithCStringNoCopy(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding, CFAllocatorRef contentsDeallocator);
 CFStringRef CFStringCreateWithFormat(CFAllocatorRef alloc, CFDictionaryRef formatOptions, CFStringRef format, ...);
 CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation);
+CFStringRef CFStringCreateWithBytesNoCopy(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation, CFAllocatorRef contentsDeallocator);
+// Borrows `bytes` from `owner`, which is kept alive instead. Bytes of a mutable owner
+// can move whenever it's edited, so those are copied after all. Same for CFData.
+CFStringRef CFStringCreateWithBytesOwner(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, CFTypeRef owner);
+CFStringRef CFStringCreateWithBytesInterned(CFMutableSetRef table, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding);
 CFIndex CFStringGetLength(CFStringRef theString);
+CFComparisonResult CFStringCompare(CFStringRef theString1, CFStringRef theString2, CFOptionFlags compareOptions);
 const char* CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding);
 CFIndex CFStringGetBytes(CFStringRef theString, CFRange range, CFStringEncoding encoding, UInt8 lossByte, Boolean isExternalRepresentation, UInt8 *buffer, CFIndex maxBufLen, CFIndex *usedBufLen);
 CFDataRef CFStringCreateExternalRepresentation(CFAllocatorRef alloc, CFStringRef theString, CFStringEncoding encoding, UInt8 lossByte);
 
 CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length);
+CFDataRef CFDataCreateWithBytesNoCopy(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, CFAllocatorRef bytesDeallocator);
+CFDataRef CFDataCreateWithBytesOwner(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, CFTypeRef owner);
 CFMutableDataRef CFDataCreateMutable(CFAllocatorRef allocator, CFIndex capacity);
 void CFDataAppendBytes(CFMutableDataRef theData, const UInt8 *bytes, CFIndex length);
 void CFDataIncreaseLength(CFMutableDataRef theData, CFIndex extraLength);
+void CFDataReserveCapacity(CFMutableDataRef theData, CFIndex capacity);
+void CFDataShrinkToFit(CFMutableDataRef theData);
 CFIndex CFDataGetLength(CFDataRef theData);
 const UInt8* CFDataGetBytePtr(CFDataRef theData);
 
 CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType theType, const void *valuePtr);
 CFNumberType CFNumberGetType(CFNumberRef number);
+CFComparisonResult CFNumberCompare(CFNumberRef number, CFNumberRef otherNumber, void *context);
 Boolean CFNumberIsFloatType(CFNumberRef number);
 Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr);
 
@@ -233,22 +430,61 @@ CFDateRef CFDateCreate(CFAllocatorRef allocator, CFAbsoluteTime at);
 CFAbsoluteTime CFDateGetAbsoluteTime(CFDateRef theDate);
 
 CFMutableArrayRef CFArrayCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFArrayCallBacks *callBacks);
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks);
+// Built in one pass like CFArrayCreate, but the result stays mutable. Same for sets and dictionaries.
+CFMutableArrayRef CFArrayCreateMutableWithValues(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks);
 void CFArrayAppendValue(CFMutableArrayRef theArray, const void *value);
+void CFArrayAppendArray(CFMutableArrayRef theArray, CFArrayRef otherArray, CFRange otherRange);
+void CFArrayGetValues(CFArrayRef theArray, CFRange range, const void **values);
+void CFArrayReplaceValues(CFMutableArrayRef theArray, CFRange range, const void **newValues, CFIndex newCount);
+void CFArrayInsertValueAtIndex(CFMutableArrayRef theArray, CFIndex idx, const void *value);
+void CFArraySetValueAtIndex(CFMutableArrayRef theArray, CFIndex idx, const void *value);
+void CFArrayRemoveValueAtIndex(CFMutableArrayRef theArray, CFIndex idx);
+void CFArrayRemoveAllValues(CFMutableArrayRef theArray);
+void CFArrayExchangeValuesAtIndices(CFMutableArrayRef theArray, CFIndex idx1, CFIndex idx2);
+void CFArraySortValues(CFMutableArrayRef theArray, CFRange range, CFComparatorFunction comparator, void *context);
+CFIndex CFArrayBSearchValues(CFArrayRef theArray, CFRange range, const void *value, CFComparatorFunction comparator, void *context);
+void CFArrayReserveCapacity(CFMutableArrayRef theArray, CFIndex capacity);
+void CFArrayShrinkToFit(CFMutableArrayRef theArray);
 CFIndex CFArrayGetCount(CFArrayRef theArray);
 const void* CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx);
 void CFArrayApplyFunction(CFArrayRef theArray, CFRange range, CFArrayApplierFunction applier, void *context);
 
+CFSetRef CFSetCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFSetCallBacks *callBacks);
+CFMutableSetRef CFSetCreateMutableWithValues(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFSetCallBacks *callBacks);
 CFMutableSetRef CFSetCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFSetCallBacks *callBacks);
 void CFSetAddValue(CFMutableSetRef theSet, const void *value);
+void CFSetReserveCapacity(CFMutableSetRef theSet, CFIndex capacity);
+void CFSetShrinkToFit(CFMutableSetRef theSet);
 CFIndex CFSetGetCount(CFSetRef theSet);
+Boolean CFSetContainsValue(CFSetRef theSet, const void *value);
+const void* CFSetGetValue(CFSetRef theSet, const void *value);
 void CFSetGetValues(CFSetRef theSet, const void **values);
 void CFSetApplyFunction(CFSetRef theSet, CFSetApplierFunction applier, void *context);
 
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks);
+CFMutableDictionaryRef CFDictionaryCreateMutableWithValues(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks);
 CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks);
 void CFDictionarySetValue(CFMutableDictionaryRef theDict, const void *key, const void *value);
 void CFDictionaryAddValue(CFMutableDictionaryRef theDict, const void *key, const void *value);
+void CFDictionaryRemoveValue(CFMutableDictionaryRef theDict, const void *key);
+void CFDictionaryReserveCapacity(CFMutableDictionaryRef theDict, CFIndex capacity);
+void CFDictionaryShrinkToFit(CFMutableDictionaryRef theDict);
+// Lets any number of threads read while others write. Readers never lock, but what they
+// get back is only guaranteed to stay alive until the end of the enclosing
+// CFEpochEnter/CFEpochExit section, or of the call itself. Each write copies the contents.
+void CFDictionaryMakeConcurrent(CFMutableDictionaryRef theDict);
+// The current contents as an immutable dictionary, for reading several things consistently.
+CFDictionaryRef CFDictionaryCopySnapshot(CFDictionaryRef theDict);
+// Persistent dictionaries are immutable tries that share structure between versions:
+// deriving a version with one key changed costs O(log n) rather than a full copy.
+// The CreateCopy functions also accept flat dictionaries, which they convert first.
+CFDictionaryRef CFDictionaryCreatePersistentCopy(CFAllocatorRef allocator, CFDictionaryRef theDict);
+CFDictionaryRef CFDictionaryCreateCopySettingValue(CFDictionaryRef theDict, const void *key, const void *value);
+CFDictionaryRef CFDictionaryCreateCopyRemovingValue(CFDictionaryRef theDict, const void *key);
 CFIndex CFDictionaryGetCount(CFDictionaryRef theDict);
 const void* CFDictionaryGetValue(CFDictionaryRef theDict, const void *key);
+Boolean CFDictionaryGetValueIfPresent(CFDictionaryRef theDict, const void *key, const void **value);
 void CFDictionaryGetKeysAndValues(CFDictionaryRef theDict, const void **keys, const void **values);
 void CFDictionaryApplyFunction(CFDictionaryRef theDict, CFDictionaryApplierFunction applier, void *context);
 
@@ -12,10 +12,25 @@
 enum
 {
     kIOCFSerializeToBinary = 0x00000001U,
+    // The caller guarantees no node appears twice in the tree, so the XML serializer can skip
+    // looking for shared ones. Any that do appear are written out in full each time.
+    kIOCFSerializeNoSharedNodes = 0x00000002U,
 };
 
+// Small integers are tagged pointers with no identity of their own (see CFNumberCreate), so
+// a repeated one is written out in full each time: no ID/IDREF in XML, no back-reference in
+// the binary format. Trees that shared such numbers decode the same, but serialize differently
+// than they did when every number was an object.
 CFDataRef IOCFSerialize(CFTypeRef object, CFOptionFlags options);
 CFTypeRef IOCFUnserializeBinary(const char *buffer, size_t bufferSize, CFAllocatorRef allocator, CFOptionFlags options, CFStringRef *errorString);
 CFTypeRef IOCFUnserializeWithSize(const char *buffer, size_t bufferSize, CFAllocatorRef allocator, CFOptionFlags options, CFStringRef *errorString);
 
+// Variants that intern decoded strings and keys in `strings`, see CFStringCreateWithBytesInterned.
+CFTypeRef IOCFUnserializeBinaryInterned(const char *buffer, size_t bufferSize, CFAllocatorRef allocator, CFOptionFlags options, CFMutableSetRef strings, CFStringRef *errorString);
+CFTypeRef IOCFUnserializeWithSizeInterned(const char *buffer, size_t bufferSize, CFAllocatorRef allocator, CFOptionFlags options, CFMutableSetRef strings, CFStringRef *errorString);
+
+// Decodes the binary format in `data` without copying <data> payloads, which keep `data` alive instead.
+// A mutable `data` gets them copied, since appending to or resizing it would move its bytes.
+CFTypeRef IOCFUnserializeBinaryData(CFDataRef data, CFAllocatorRef allocator, CFOptionFlags options, CFMutableSetRef strings, CFStringRef *errorString);
+
 #endif /* _BOOTLEG_IOCFSERIALIZE */
@@ -4,5 +4,7 @@
 #include <CoreFoundation/CoreFoundation.h>
 
 extern CFTypeRef IOCFUnserialize(const char *buf, CFAllocatorRef allocator, CFOptionFlags options, CFStringRef *err);
+// Same, but strings and keys are looked up in (or added to) `strings`, see CFStringCreateWithBytesInterned.
+extern CFTypeRef IOCFUnserializeInterned(const char *buf, CFAllocatorRef allocator, CFOptionFlags options, CFMutableSetRef strings, CFStringRef *err);
 
 #endif /* _BOOTLEG_IOCFUNSERIALIZE */
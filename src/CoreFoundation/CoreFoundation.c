@@ -5,704 +5,4187 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if defined(__linux__) || defined(__APPLE__)
+#   include <sys/random.h>
+#endif
+#ifndef _WIN32
+#   include <pthread.h>
+#endif
 
 #include <CoreFoundation/CoreFoundation.h>
 
-const CFBooleanRef kCFBooleanTrue  = &(const struct CFBoolean){ kCFTypeBoolean, 0xffffffff, true };
-const CFBooleanRef kCFBooleanFalse = &(const struct CFBoolean){ kCFTypeBoolean, 0xffffffff, false };
+// Marks removed entries in a dictionary's elements array until the next compaction.
+static const char RemovedKey;
+#define kRemovedKey ((const void*)&RemovedKey)
+
+const CFBooleanRef kCFBooleanTrue  = CF_TAGGED_BOOLEAN(true);
+const CFBooleanRef kCFBooleanFalse = CF_TAGGED_BOOLEAN(false);
 
 const struct CFCallbacks kCFTypeArrayCallBacks =
 {
     .retain  = CFRetain,
     .release = CFRelease,
     .equal   = CFEqual,
+    .hash    = CFHash,
 };
 const struct CFCallbacks kCFTypeSetCallBacks =
 {
     .retain  = CFRetain,
     .release = CFRelease,
     .equal   = CFEqual,
+    .hash    = CFHash,
 };
 const struct CFCallbacks kCFTypeDictionaryKeyCallBacks =
 {
     .retain  = CFRetain,
     .release = CFRelease,
     .equal   = CFEqual,
+    .hash    = CFHash,
 };
 const struct CFCallbacks kCFTypeDictionaryValueCallBacks =
 {
     .retain  = CFRetain,
     .release = CFRelease,
     .equal   = CFEqual,
+    .hash    = CFHash,
 };
 
-CFTypeID CFGetTypeID(CFTypeRef cf)
-{
-    return ((const struct CFBase*)cf)->type;
-}
+// Per-process random seed, so that colliding keys can't be precomputed.
+static uint64_t HashSeed;
 
-CFTypeRef CFRetain(CFTypeRef cf)
+__attribute__((constructor)) static void HashSeedInit(void)
 {
-    struct CFBase *base = (struct CFBase*)cf;
-    uint32_t oldval = base->refcnt;
-    do
+    uint64_t seed = 0;
+#if defined(__linux__) || defined(__APPLE__)
+    if(getentropy(&seed, sizeof(seed)) == 0)
     {
-        if(oldval == 0xffffffff)
-        {
-            return cf;
-        }
+        HashSeed = seed;
+        return;
     }
-    while(!__c11_atomic_compare_exchange_strong(&base->refcnt, &oldval, oldval + 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
-    return cf;
+#endif
+    seed ^= (uint64_t)time(NULL) << 32;
+    seed ^= (uint64_t)clock();
+    seed ^= (uint64_t)(uintptr_t)&seed;
+    seed ^= (uint64_t)(uintptr_t)&HashSeedInit << 16;
+    HashSeed = seed;
 }
 
-void CFRelease(CFTypeRef cf)
+#define HASH_SECRET0 0xa0761d6478bd642fULL
+#define HASH_SECRET1 0xe7037ed1a0b428dbULL
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ULL
+#define HASH_SECRET3 0x589965cc75374cc3ULL
+
+static inline void HashMum(uint64_t *a, uint64_t *b)
 {
-    struct CFBase *base = (struct CFBase*)cf;
-    uint32_t oldval = base->refcnt;
-    do
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t HashMix(uint64_t a, uint64_t b)
+{
+    HashMum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t HashRead64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t HashRead32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash-style keyed hash over a byte range.
+static uint64_t HashBytes(const void *data, CFIndex len)
+{
+    const uint8_t *p = data;
+    uint64_t seed = HashSeed ^ HashMix(HashSeed ^ HASH_SECRET0, HASH_SECRET1);
+    uint64_t a, b;
+    if(len <= 16)
     {
-        if(oldval == 0xffffffff)
+        if(len >= 4)
         {
-            return;
+            a = (HashRead32(p) << 32) | HashRead32(p + ((len >> 3) << 2));
+            b = (HashRead32(p + len - 4) << 32) | HashRead32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
         }
     }
-    while(!__c11_atomic_compare_exchange_strong(&base->refcnt, &oldval, oldval - 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
-    if(oldval == 0)
+    else
     {
-        switch(base->type)
+        CFIndex i = len;
+        if(i > 48)
         {
-            case kCFTypeData:
-            {
-                struct CFData *data = (struct CFData*)base;
-                if(data->bytes)
-                {
-                    free(data->bytes);
-                }
-                break;
-            }
-            case kCFTypeArray:
-            case kCFTypeSet:
-            {
-                struct CFArray *arr = (struct CFArray*)base;
-                if(arr->callbacks && arr->callbacks->release)
-                {
-                    void (*release)(const void*) = arr->callbacks->release;
-                    for(CFIndex i = 0; i < arr->length; ++i)
-                    {
-                        release(arr->elements[i]);
-                    }
-                }
-                free(arr->elements);
-                break;
-            }
-            case kCFTypeDictionary:
+            uint64_t see1 = seed, see2 = seed;
+            do
             {
-                struct CFDictionary *dict = (struct CFDictionary*)base;
-                if(dict->keyCallbacks && dict->keyCallbacks->release)
-                {
-                    void (*release)(const void*) = dict->keyCallbacks->release;
-                    for(CFIndex i = 0; i < dict->length; ++i)
-                    {
-                        release(dict->elements[i].key);
-                    }
-                }
-                if(dict->valueCallbacks && dict->valueCallbacks->release)
-                {
-                    void (*release)(const void*) = dict->valueCallbacks->release;
-                    for(CFIndex i = 0; i < dict->length; ++i)
-                    {
-                        release(dict->elements[i].value);
-                    }
-                }
-                free(dict->elements);
-                break;
+                seed = HashMix(HashRead64(p)      ^ HASH_SECRET1, HashRead64(p + 8)  ^ seed);
+                see1 = HashMix(HashRead64(p + 16) ^ HASH_SECRET2, HashRead64(p + 24) ^ see1);
+                see2 = HashMix(HashRead64(p + 32) ^ HASH_SECRET3, HashRead64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
             }
-            default:
-                break;
+            while(i > 48);
+            seed ^= see1 ^ see2;
         }
-        free(base);
+        while(i > 16)
+        {
+            seed = HashMix(HashRead64(p) ^ HASH_SECRET1, HashRead64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = HashRead64(p + i - 16);
+        b = HashRead64(p + i - 8);
     }
+    a ^= HASH_SECRET1;
+    b ^= seed;
+    HashMum(&a, &b);
+    return HashMix(a ^ HASH_SECRET0 ^ (uint64_t)len, b ^ HASH_SECRET1);
 }
 
-static Boolean NullEqual(CFTypeRef cf1, CFTypeRef cf2)
+static inline uint64_t HashPointer(const void *ptr)
 {
-    return cf1 == cf2;
+    return HashMix((uint64_t)(uintptr_t)ptr ^ HashSeed, HASH_SECRET0);
 }
 
-Boolean CFEqual(CFTypeRef cf1, CFTypeRef cf2)
+enum
 {
-    if(cf1 == cf2)
-        return true;
+    // The object's allocator is stored in the word right before it.
+    kCFObjectFlagAllocator = 0x0001,
+    // The string's bytes are stored in inlineBytes.
+    kCFStringFlagInline    = 0x0002,
+    // Only referenced from the creating thread so far, see CFSetThreadPrivateRefcounts.
+    kCFObjectFlagPrivate   = 0x0004,
+    // Part of a frozen tree, never changes again.
+    kCFObjectFlagFrozen    = 0x0008,
+    // Nonzero if the object came from a slab pool, holds the size class + 1.
+    kCFObjectPoolMask      = 0x00f0,
+    kCFObjectPoolShift     = 4,
+    // Allocator flags.
+    kCFAllocatorFlagArena  = 0x0100,
+    // The data's or string's bytes are borrowed, their owner is stored right after the struct.
+    kCFObjectFlagBorrowed  = 0x0200,
+    // The string's bytes are borrowed and not known to be NUL-terminated.
+    kCFStringFlagUnterminated = 0x0400,
+    // Created by one of the CF*CreateMutable functions.
+    kCFObjectFlagMutable   = 0x0800,
+    // The dictionary's contents live in its snapshot, see CFDictionaryMakeConcurrent.
+    kCFDictionaryFlagConcurrent = 0x1000,
+    // The dictionary's contents live in a trie shared with other versions, see CFHamtNode.
+    kCFDictionaryFlagPersistent = 0x2000,
+};
 
-    CFTypeID type = CFGetTypeID(cf1);
-    if(type != CFGetTypeID(cf2))
-        return false;
+#define ALLOCATOR_PREFIX_SIZE 8
+#define ARENA_ALIGNMENT       8
+#define ARENA_MIN_CHUNK_SIZE  0x10000
+#define ARENA_MAX_CHUNK_SIZE  0x1000000
+
+struct CFArenaChunk
+{
+    struct CFArenaChunk *next;
+    CFIndex size;
+};
+
+static inline const char* StringBytes(CFStringRef theString)
+{
+    const struct CFString *str = theString;
+    return (str->flags & kCFStringFlagInline) ? str->inlineBytes : str->str;
+}
+
+// Concurrent dictionaries keep their contents in an immutable snapshot, which is
+// only safe to use inside an epoch section.
+static inline const struct CFDictionary* DictionaryResolve(const struct CFDictionary *dict)
+{
+    if(!(dict->flags & kCFDictionaryFlagConcurrent))
+        return dict;
+    return __c11_atomic_load(&((struct CFDictionary*)dict)->snapshot, __ATOMIC_ACQUIRE);
+}
 
+static inline const struct CFDictionary* DictionaryReadBegin(CFDictionaryRef theDict)
+{
+    const struct CFDictionary *dict = theDict;
+    if(!(dict->flags & kCFDictionaryFlagConcurrent))
+        return dict;
+    CFEpochEnter();
+    return DictionaryResolve(dict);
+}
+
+static inline void DictionaryReadEnd(CFDictionaryRef theDict)
+{
+    if(((const struct CFDictionary*)theDict)->flags & kCFDictionaryFlagConcurrent)
+        CFEpochExit();
+}
+
+// Header is the fixed-size struct of a type; payload is everything else an object
+// owns: bytes stored after the struct, and separately allocated buffers.
+static CFIndex ObjectHeaderSize(CFTypeID type)
+{
     switch(type)
     {
-        case kCFTypeString:
-            return strcmp(((const struct CFString*)cf1)->str, ((const struct CFString*)cf2)->str) == 0;
+        case kCFTypeString:     return sizeof(struct CFString);
+        case kCFTypeData:       return sizeof(struct CFData);
+        case kCFTypeNumber:     return sizeof(struct CFNumber);
+        case kCFTypeDate:       return sizeof(struct CFDate);
+        case kCFTypeArray:      return sizeof(struct CFArray);
+        case kCFTypeSet:        return sizeof(struct CFSet);
+        case kCFTypeDictionary: return sizeof(struct CFDictionary);
+        case kCFTypeAllocator:  return sizeof(struct CFAllocator);
+        default:                return 0;
+    }
+}
+
+// Bytes allocated together with the header, past the struct.
+static CFIndex ObjectInlineSize(const struct CFBase *base)
+{
+    if(base->flags & kCFObjectFlagBorrowed)
+        return sizeof(CFTypeRef);
+    if(base->type == kCFTypeString && !(base->flags & kCFStringFlagInline))
+        return ((const struct CFString*)base)->length + 1;
+    return 0;
+}
+
+static inline CFIndex HashIndexSize(CFIndex buckets);
+
+// Buffers allocated separately from the header.
+static CFIndex ObjectBufferSize(const struct CFBase *base)
+{
+    switch(base->type)
+    {
         case kCFTypeData:
+            return base->flags & kCFObjectFlagBorrowed ? 0 : ((const struct CFData*)base)->capacity;
+        case kCFTypeArray:
+            return ((const struct CFArray*)base)->capacity * sizeof(void*);
+        case kCFTypeSet:
         {
-            const struct CFData *dt1 = cf1,
-                                *dt2 = cf2;
-            return dt1->length == dt2->length && memcmp(dt1->bytes, dt2->bytes, dt1->length) == 0;
+            const struct CFSet *set = (const struct CFSet*)base;
+            return set->capacity * sizeof(*set->elements) + (set->index.slots ? HashIndexSize(set->index.buckets) : 0);
         }
-        case kCFTypeNumber:
+        case kCFTypeDictionary:
         {
-            const struct CFNumber *num1 = cf1,
-                                  *num2 = cf2;
-            if(num1->numType != num2->numType)
-                return false;
-            switch(num1->numType)
+            const struct CFDictionary *dict = (const struct CFDictionary*)base;
+            return dict->capacity * sizeof(*dict->elements) + (dict->index.slots ? HashIndexSize(dict->index.buckets) : 0);
+        }
+        case kCFTypeAllocator:
+        {
+            CFIndex size = 0;
+            for(const struct CFArenaChunk *chunk = ((const struct CFAllocator*)base)->chunks; chunk; chunk = chunk->next)
             {
-                case kCFNumberLongLongType:
-                    return num1->value.l == num2->value.l;
-                case kCFNumberDoubleType:
-                    return num1->value.d == num2->value.d;
-                default:
-                    return false;
+                size += chunk->size;
             }
+            return size;
         }
         default:
-            return false;
+            return 0;
     }
 }
 
-Boolean CFBooleanGetValue(CFBooleanRef boolean)
+// Define CF_MEMORY_ACCOUNTING to 1 to keep live object and byte counts per type,
+// see CFMemoryGetStatistics. Otherwise MEMORY_ACCOUNT compiles to nothing.
+#ifndef CF_MEMORY_ACCOUNTING
+#   define CF_MEMORY_ACCOUNTING 0
+#endif
+
+#define CF_TYPE_COUNT (kCFTypeAllocator + 1)
+
+#if CF_MEMORY_ACCOUNTING
+static struct
 {
-    return ((const struct CFBoolean*)boolean)->value;
-}
+    _Atomic int64_t objects;
+    _Atomic int64_t headerBytes;
+    _Atomic int64_t payloadBytes;
+} MemoryAccounts[CF_TYPE_COUNT];
 
-CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding)
+static void MemoryAccount(const struct CFBase *base, int64_t objects, int64_t headerBytes, int64_t payloadBytes)
 {
-    size_t len = strlen(cStr);
-    return CFStringCreateWithBytes(alloc, (const UInt8*)cStr, len, encoding, false);
+    // Arena objects are immortal; their memory counts as the arena's chunks.
+    if(__c11_atomic_load(&((struct CFBase*)base)->refcnt, __ATOMIC_RELAXED) == 0xffffffff)
+        return;
+    __c11_atomic_fetch_add(&MemoryAccounts[base->type].objects, objects, __ATOMIC_RELAXED);
+    __c11_atomic_fetch_add(&MemoryAccounts[base->type].headerBytes, headerBytes, __ATOMIC_RELAXED);
+    __c11_atomic_fetch_add(&MemoryAccounts[base->type].payloadBytes, payloadBytes, __ATOMIC_RELAXED);
 }
+#   define MEMORY_ACCOUNT(base, objects, headerBytes, payloadBytes) MemoryAccount((const struct CFBase*)(base), objects, headerBytes, payloadBytes)
+#else
+#   define MEMORY_ACCOUNT(base, objects, headerBytes, payloadBytes) do {} while(0)
+#endif
 
-CFStringRef CFStringCreateWithCStringNoCopy(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding, CFAllocatorRef contentsDeallocator)
+CFIndex CFMemoryGetStatistics(CFMemoryStatistics *stats, CFIndex count)
 {
-    if(encoding != kCFStringEncodingUTF8)
-        abort();
-    if(contentsDeallocator)
-        abort();
-
-    struct CFString *str = malloc(sizeof(struct CFString));
-    if(str)
+#if CF_MEMORY_ACCOUNTING
+    for(CFIndex type = 0; type < count && type < CF_TYPE_COUNT; ++type)
     {
-        str->type = kCFTypeString;
-        str->refcnt = 1;
-        str->str = cStr;
+        stats[type].objects = __c11_atomic_load(&MemoryAccounts[type].objects, __ATOMIC_RELAXED);
+        stats[type].headerBytes = __c11_atomic_load(&MemoryAccounts[type].headerBytes, __ATOMIC_RELAXED);
+        stats[type].payloadBytes = __c11_atomic_load(&MemoryAccounts[type].payloadBytes, __ATOMIC_RELAXED);
     }
-    return str;
+    return CF_TYPE_COUNT;
+#else
+    (void)stats;
+    (void)count;
+    return 0;
+#endif
 }
 
-CFStringRef CFStringCreateWithFormat(CFAllocatorRef alloc, CFDictionaryRef formatOptions, CFStringRef format, ...)
-{
-    if(formatOptions != NULL)
-        abort();
+// Nodes of persistent dictionaries: a hash array mapped trie, indexed by HAMT_BITS
+// of the key's hash per level. Entries stored in a node come first in `slots`, as
+// key/value pairs in bitmap order, then the children. Once the hash bits run out,
+// nodes are plain lists of colliding entries. Nodes are immutable and refcounted,
+// so that versions can share them, and always come from the default allocator.
+#define HAMT_BITS      5
+#define HAMT_MAX_DEPTH 13
 
-    va_list ap;
-    va_start(ap, format);
-    char *buf = NULL;
-    int r = vasprintf(&buf, ((const struct CFString*)format)->str, ap);
-    va_end(ap);
+struct CFHamtNode
+{
+    _Atomic uint32_t refcnt;
+    uint16_t entries;
+    uint16_t children;
+    uint32_t dataMap;
+    uint32_t nodeMap;
+    const void *slots[];
+};
 
-    if(r < 0)
-        return NULL;
+static inline CFIndex HamtNodeSize(CFIndex entries, CFIndex children)
+{
+    return sizeof(struct CFHamtNode) + (2 * entries + children) * sizeof(void*);
+}
 
-    CFStringRef str = CFStringCreateWithCString(alloc, buf, kCFStringEncodingUTF8);
-    free(buf);
-    return str;
+static inline struct CFHamtNode* HamtChild(const struct CFHamtNode *node, CFIndex i)
+{
+    return (struct CFHamtNode*)node->slots[2 * node->entries + i];
 }
 
-CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation)
+// Walks the entries of a flat or persistent dictionary.
+struct DictionaryIterator
 {
-    if(encoding != kCFStringEncodingUTF8)
-        abort();
-    if(isExternalRepresentation)
-        abort();
+    const struct CFDictionary *dict;
+    CFIndex index;
+    CFIndex depth;
+    struct
+    {
+        const struct CFHamtNode *node;
+        CFIndex next;
+    } path[HAMT_MAX_DEPTH + 1];
+};
 
-    struct CFString *str = malloc(sizeof(struct CFString) + numBytes + 1);
-    if(str)
+static inline void DictionaryIteratorInit(struct DictionaryIterator *it, const struct CFDictionary *dict)
+{
+    it->dict = dict;
+    it->index = 0;
+    it->depth = 0;
+    if((dict->flags & kCFDictionaryFlagPersistent) && dict->root)
     {
-        char *buf = (char*)(str + 1);
-        memcpy(buf, bytes, numBytes);
-        buf[numBytes] = '\0';
-        str->type = kCFTypeString;
-        str->refcnt = 1;
-        str->str = buf;
+        it->path[0].node = dict->root;
+        it->path[0].next = 0;
+        it->depth = 1;
     }
-    return str;
 }
 
-CFIndex CFStringGetLength(CFStringRef theString)
+static Boolean DictionaryNext(struct DictionaryIterator *it, const void **key, const void **value)
 {
-    return strlen(((const struct CFString*)theString)->str);
+    const struct CFDictionary *dict = it->dict;
+    if(!(dict->flags & kCFDictionaryFlagPersistent))
+    {
+        while(it->index < dict->length)
+        {
+            CFIndex i = it->index++;
+            if(dict->elements[i].key != kRemovedKey)
+            {
+                *key = dict->elements[i].key;
+                *value = dict->elements[i].value;
+                return true;
+            }
+        }
+        return false;
+    }
+    while(it->depth)
+    {
+        const struct CFHamtNode *node = it->path[it->depth - 1].node;
+        CFIndex i = it->path[it->depth - 1].next++;
+        if(i < node->entries)
+        {
+            *key = node->slots[2 * i];
+            *value = node->slots[2 * i + 1];
+            return true;
+        }
+        if(i < node->entries + node->children)
+        {
+            it->path[it->depth].node = HamtChild(node, i - node->entries);
+            it->path[it->depth].next = 0;
+            ++it->depth;
+            continue;
+        }
+        --it->depth;
+    }
+    return false;
 }
 
-const char* CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding)
+static inline Boolean AllocatorIsArena(CFAllocatorRef allocator)
 {
-    if(encoding != kCFStringEncodingUTF8)
-        return NULL;
-
-    return ((const struct CFString*)theString)->str;
+    return allocator && (((const struct CFAllocator*)allocator)->flags & kCFAllocatorFlagArena);
 }
 
-CFIndex CFStringGetBytes(CFStringRef theString, CFRange range, CFStringEncoding encoding, UInt8 lossByte, Boolean isExternalRepresentation, UInt8 *buffer, CFIndex maxBufLen, CFIndex *usedBufLen)
+static Boolean ArenaGrow(struct CFAllocator *arena, CFIndex size)
 {
-    if(encoding != kCFStringEncodingUTF8)
-        abort();
-
-    if(range[1] <= range[0])
+    CFIndex chunkSize = arena->chunkSize;
+    if(chunkSize < ARENA_MAX_CHUNK_SIZE)
     {
-        if(usedBufLen)
-            *usedBufLen = 0;
-        return 0;
+        arena->chunkSize *= 2;
     }
-    CFIndex num = range[1] - range[0];
-    if(num > maxBufLen)
-        num = maxBufLen;
-    if(buffer)
-        memcpy(buffer, ((const struct CFString*)theString)->str, num);
-    if(usedBufLen) *usedBufLen = num;
-    return num;
+    if(chunkSize < size + (CFIndex)sizeof(struct CFArenaChunk))
+    {
+        chunkSize = size + sizeof(struct CFArenaChunk);
+    }
+    struct CFArenaChunk *chunk = CFAllocatorAllocate(CFGetAllocator(arena), chunkSize, 0);
+    if(!chunk)
+        return false;
+    chunk->next = arena->chunks;
+    chunk->size = chunkSize;
+    arena->chunks = chunk;
+    MEMORY_ACCOUNT(arena, 0, 0, chunkSize);
+    arena->cursor = (uint8_t*)(chunk + 1);
+    arena->end = (uint8_t*)chunk + chunkSize;
+    return true;
 }
 
-CFDataRef CFStringCreateExternalRepresentation(CFAllocatorRef alloc, CFStringRef theString, CFStringEncoding encoding, UInt8 lossByte)
+static void* ArenaAllocate(struct CFAllocator *arena, CFIndex size)
 {
-    if(encoding != kCFStringEncodingUTF8)
-        abort();
-
-    return CFDataCreate(NULL, (const UInt8*)((const struct CFString*)theString)->str, CFStringGetLength(theString));
+    size = size ? (size + ARENA_ALIGNMENT - 1) & ~(CFIndex)(ARENA_ALIGNMENT - 1) : ARENA_ALIGNMENT;
+    if((CFIndex)(arena->end - arena->cursor) < size && !ArenaGrow(arena, size))
+        return NULL;
+    void *ptr = arena->cursor;
+    arena->cursor += size;
+    arena->last = ptr;
+    return ptr;
 }
 
-CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length)
+// Only the most recent allocation can be resized in place;
+// anything else is copied into a new block and the old one is abandoned.
+static void* ArenaResize(struct CFAllocator *arena, void *ptr, CFIndex oldSize, CFIndex newSize)
 {
-    struct CFData *data = malloc(sizeof(struct CFData));
-    if(data)
+    if(ptr && ptr == arena->last)
     {
-        void *buf = malloc(length);
-        if(buf)
-        {
-            memcpy(buf, bytes, length);
-            data->type = kCFTypeData;
-            data->refcnt = 1;
-            data->bytes = buf;
-            data->length = length;
-            data->capacity = length;
-        }
-        else
+        CFIndex size = (newSize + ARENA_ALIGNMENT - 1) & ~(CFIndex)(ARENA_ALIGNMENT - 1);
+        if(size <= (CFIndex)(arena->end - (uint8_t*)ptr))
         {
-            free(data);
-            data = NULL;
+            arena->cursor = (uint8_t*)ptr + size;
+            return ptr;
         }
     }
-    return data;
+    else if(ptr && newSize <= oldSize)
+    {
+        return ptr;
+    }
+    void *newPtr = ArenaAllocate(arena, newSize);
+    if(newPtr && ptr)
+        memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+    return newPtr;
 }
 
-CFMutableDataRef CFDataCreateMutable(CFAllocatorRef allocator, CFIndex capacity)
+// Upper bound on the size of an arena block whose size we weren't told.
+static CFIndex ArenaBlockLimit(const struct CFAllocator *arena, const void *ptr)
 {
-    struct CFData *data = malloc(sizeof(struct CFData));
-    if(data)
+    const uint8_t *p = ptr;
+    if(ptr == arena->last)
+        return arena->cursor - p;
+    if(arena->buffer && p >= arena->buffer && p < (const uint8_t*)arena->context.info)
+        return (const uint8_t*)arena->context.info - p;
+    for(const struct CFArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
     {
-        data->type = kCFTypeData;
-        data->refcnt = 1;
-        data->bytes = NULL;
-        data->length = 0;
-        data->capacity = capacity;
+        const uint8_t *end = (const uint8_t*)chunk + chunk->size;
+        if(p > (const uint8_t*)chunk && p < end)
+            return end - p;
+    }
+    return 0;
+}
 
-        if(capacity)
+// Allocates nothing and deallocates nothing, for bytes that aren't ours to free.
+static struct CFAllocator NullAllocator = { kCFTypeAllocator, 0, 0xffffffff };
+const CFAllocatorRef kCFAllocatorNull = &NullAllocator;
+
+CFAllocatorRef CFAllocatorCreate(CFAllocatorRef allocator, CFAllocatorContext *context)
+{
+    struct CFAllocator *alloc = CFAllocatorAllocate(allocator, ALLOCATOR_PREFIX_SIZE + sizeof(struct CFAllocator), 0);
+    if(alloc)
+    {
+        *(CFAllocatorRef*)alloc = allocator ? (CFAllocatorRef)CFRetain(allocator) : NULL;
+        alloc = (struct CFAllocator*)((uintptr_t)alloc + ALLOCATOR_PREFIX_SIZE);
+        memset(alloc, 0, sizeof(*alloc));
+        alloc->type = kCFTypeAllocator;
+        alloc->flags = kCFObjectFlagAllocator;
+        alloc->refcnt = 1;
+        MEMORY_ACCOUNT(alloc, 1, sizeof(struct CFAllocator), 0);
+        if(context)
         {
-            data->bytes = malloc(capacity);
-            if(!data->bytes)
-            {
-                free(data);
-                data = NULL;
-            }
+            alloc->context = *context;
+            if(context->retain)
+                alloc->context.info = (void*)context->retain(context->info);
         }
     }
-    return data;
+    return alloc;
 }
 
-void CFDataAppendBytes(CFMutableDataRef theData, const UInt8 *bytes, CFIndex length)
+CFAllocatorRef CFAllocatorCreateArena(CFAllocatorRef allocator, void *buffer, CFIndex size)
 {
-    // TODO: thread safety
-    if(!length)
-        return;
-
-    struct CFData *data = theData;
-    if(data->capacity > 0)
-    {
-        if(length > (data->capacity - data->length))
-            abort();
-    }
-    else
+    struct CFAllocator *arena = (struct CFAllocator*)CFAllocatorCreate(allocator, NULL);
+    if(arena)
     {
-        void *buf = realloc(data->bytes, data->length + length);
-        if(!buf)
-            abort();
-        data->bytes = buf;
+        arena->flags |= kCFAllocatorFlagArena;
+        arena->chunkSize = ARENA_MIN_CHUNK_SIZE;
+        if(buffer)
+        {
+            // Keep the caller's block aligned; its end is remembered in context.info.
+            uintptr_t start = ((uintptr_t)buffer + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1);
+            uintptr_t end = (uintptr_t)buffer + size;
+            if(start < end)
+            {
+                arena->buffer = arena->cursor = (uint8_t*)start;
+                arena->end = (uint8_t*)end;
+                arena->context.info = arena->end;
+            }
+        }
     }
-    if(bytes)
-        memcpy((void*)((uintptr_t)data->bytes + data->length), bytes, length);
-    else
-        memset((void*)((uintptr_t)data->bytes + data->length), 0, length);
-    data->length += length;
+    return arena;
 }
 
-void CFDataIncreaseLength(CFMutableDataRef theData, CFIndex extraLength)
+void* CFAllocatorAllocate(CFAllocatorRef allocator, CFIndex size, CFOptionFlags hint)
 {
-    CFDataAppendBytes(theData, NULL, extraLength);
+    struct CFAllocator *alloc = allocator;
+    if(!alloc)
+        return malloc(size);
+    if(alloc->flags & kCFAllocatorFlagArena)
+        return ArenaAllocate(alloc, size);
+    if(!alloc->context.allocate)
+        return NULL;
+    return alloc->context.allocate(size, hint, alloc->context.info);
 }
 
-CFIndex CFDataGetLength(CFDataRef theData)
+void* CFAllocatorReallocate(CFAllocatorRef allocator, void *ptr, CFIndex newsize, CFOptionFlags hint)
 {
-    return ((struct CFData*)theData)->length;
+    struct CFAllocator *alloc = allocator;
+    if(!ptr)
+        return newsize ? CFAllocatorAllocate(allocator, newsize, hint) : NULL;
+    if(!newsize)
+    {
+        CFAllocatorDeallocate(allocator, ptr);
+        return NULL;
+    }
+    if(!alloc)
+        return realloc(ptr, newsize);
+    if(alloc->flags & kCFAllocatorFlagArena)
+        return ArenaResize(alloc, ptr, ArenaBlockLimit(alloc, ptr), newsize);
+    if(!alloc->context.reallocate)
+        return NULL;
+    return alloc->context.reallocate(ptr, newsize, hint, alloc->context.info);
 }
 
-const UInt8* CFDataGetBytePtr(CFDataRef theData)
+void CFAllocatorDeallocate(CFAllocatorRef allocator, void *ptr)
 {
-    return ((struct CFData*)theData)->bytes;
+    struct CFAllocator *alloc = allocator;
+    if(!ptr)
+        return;
+    if(!alloc)
+    {
+        free(ptr);
+    }
+    else if(alloc->flags & kCFAllocatorFlagArena)
+    {
+        // Give back the most recent allocation, everything else waits for the arena.
+        if(ptr == alloc->last)
+        {
+            alloc->cursor = ptr;
+            alloc->last = NULL;
+        }
+    }
+    else if(alloc->context.deallocate)
+    {
+        alloc->context.deallocate(ptr, alloc->context.info);
+    }
 }
 
-CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType theType, const void *valuePtr)
+void CFAllocatorGetContext(CFAllocatorRef allocator, CFAllocatorContext *context)
 {
-    struct CFNumber *num = malloc(sizeof(struct CFNumber));
-    if(num)
+    const struct CFAllocator *alloc = allocator;
+    if(alloc && !(alloc->flags & kCFAllocatorFlagArena))
+        *context = alloc->context;
+    else
+        memset(context, 0, sizeof(*context));
+}
+
+// Like CFAllocatorReallocate, but for callers that know the current size,
+// which lets arenas and allocators without a reallocate callback copy exactly.
+static void* AllocatorResize(CFAllocatorRef allocator, void *ptr, CFIndex oldSize, CFIndex newSize)
+{
+    struct CFAllocator *alloc = allocator;
+    if(!alloc)
+        return realloc(ptr, newSize);
+    if(alloc->flags & kCFAllocatorFlagArena)
+        return ArenaResize(alloc, ptr, oldSize, newSize);
+    if(ptr && alloc->context.reallocate)
+        return alloc->context.reallocate(ptr, newSize, 0, alloc->context.info);
+    void *newPtr = CFAllocatorAllocate(allocator, newSize, 0);
+    if(newPtr && ptr)
     {
-        num->type = kCFTypeNumber;
-        num->refcnt = 1;
-        switch(theType)
-        {
-#define MAPTYPE(enumtype, ctype, internaltype, field)       \
-            case enumtype:                                  \
-                num->value.field = *(const ctype*)valuePtr; \
-                num->numType = internaltype;                \
-                break;
+        memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+        CFAllocatorDeallocate(allocator, ptr);
+    }
+    return newPtr;
+}
 
-            MAPTYPE(kCFNumberSInt8Type,     int8_t,         kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberSInt16Type,    int16_t,        kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberSInt32Type,    int32_t,        kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberSInt64Type,    int64_t,        kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberCharType,      char,           kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberIntType,       int,            kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberLongType,      long,           kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberLongLongType,  long long,      kCFNumberLongLongType, l)
-            MAPTYPE(kCFNumberCGFloatType,   CGFLOAT_TYPE,   kCFNumberDoubleType,   d)
-            MAPTYPE(kCFNumberFloat32Type,   float,          kCFNumberDoubleType,   d)
-            MAPTYPE(kCFNumberFloat64Type,   double,         kCFNumberDoubleType,   d)
-            MAPTYPE(kCFNumberFloatType,     float,          kCFNumberDoubleType,   d)
-            MAPTYPE(kCFNumberDoubleType,    double,         kCFNumberDoubleType,   d)
+// The one growth policy for data and all containers: double, starting at `minimum`,
+// but never to less than what is needed right now.
+static CFIndex GrowCapacity(CFIndex capacity, CFIndex needed, CFIndex minimum)
+{
+    CFIndex newCapacity = capacity < minimum ? minimum : capacity * 2;
+    return newCapacity < needed ? needed : newCapacity;
+}
 
-#undef MAPTYPE
+// Resizes a buffer of `oldCapacity` elements to exactly `newCapacity`, freeing it at 0.
+static void* BufferSetCapacity(CFAllocatorRef allocator, void *ptr, CFIndex oldCapacity, CFIndex newCapacity, size_t size)
+{
+    if(!newCapacity)
+    {
+        CFAllocatorDeallocate(allocator, ptr);
+        return NULL;
+    }
+    void *newPtr = AllocatorResize(allocator, ptr, oldCapacity * size, newCapacity * size);
+    if(!newPtr)
+        abort();
+    return newPtr;
+}
 
-            default:
-                abort();
-                break;
-        }
+static inline void SpinLock(_Atomic uint32_t *lock)
+{
+    while(__c11_atomic_exchange(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__c11_atomic_load(lock, __ATOMIC_RELAXED)) {}
     }
-    return num;
 }
 
-CFNumberType CFNumberGetType(CFNumberRef number)
+static inline Boolean SpinTryLock(_Atomic uint32_t *lock)
 {
-    return ((const struct CFNumber*)number)->numType;
+    return !__c11_atomic_load(lock, __ATOMIC_RELAXED) && !__c11_atomic_exchange(lock, 1, __ATOMIC_ACQUIRE);
 }
 
-Boolean CFNumberIsFloatType(CFNumberRef number)
+static inline void SpinUnlock(_Atomic uint32_t *lock)
 {
-    return ((const struct CFNumber*)number)->numType == kCFNumberDoubleType;
+    __c11_atomic_store(lock, 0, __ATOMIC_RELEASE);
 }
 
-Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr)
+// Slab pools for the fixed-size headers of objects on the default allocator.
+// Each thread keeps a free list per size class and trades batches of objects
+// with a global free list, which in turn is fed by slabs that are never returned.
+#define POOL_GRANULE    16
+#define POOL_CLASSES    8
+#define POOL_MAX_SIZE   (POOL_GRANULE * POOL_CLASSES)
+#define POOL_BATCH      32
+#define POOL_SLAB_SIZE  0x4000
+
+struct PoolObject
 {
-    const struct CFNumber *num = number;
-    switch(theType)
-    {
-#define MAPTYPE(enumtype, ctype, internaltype, field)       \
-        case enumtype:                                      \
-            if(num->numType != internaltype)                \
-                return false;                               \
-            *(ctype*)valuePtr = (ctype)num->value.field;    \
-            return true;
+    struct PoolObject *next;
+};
 
-        MAPTYPE(kCFNumberSInt8Type,     int8_t,         kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberSInt16Type,    int16_t,        kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberSInt32Type,    int32_t,        kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberSInt64Type,    int64_t,        kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberCharType,      char,           kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberIntType,       int,            kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberLongType,      long,           kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberLongLongType,  long long,      kCFNumberLongLongType, l)
-        MAPTYPE(kCFNumberCGFloatType,   CGFLOAT_TYPE,   kCFNumberDoubleType,   d)
-        MAPTYPE(kCFNumberFloat32Type,   float,          kCFNumberDoubleType,   d)
-        MAPTYPE(kCFNumberFloat64Type,   double,         kCFNumberDoubleType,   d)
-        MAPTYPE(kCFNumberFloatType,     float,          kCFNumberDoubleType,   d)
-        MAPTYPE(kCFNumberDoubleType,    double,         kCFNumberDoubleType,   d)
+struct PoolCache
+{
+    struct PoolObject *head;
+    CFIndex count;
+};
 
-#undef MAPTYPE
+static struct Pool
+{
+    _Atomic uint32_t lock;
+    struct PoolObject *head;
+    CFIndex count;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t frees;
+    _Atomic uint64_t slabs;
+} Pools[POOL_CLASSES];
 
-        default:
-            abort();
-            return false;
+static _Thread_local struct PoolCache PoolCaches[POOL_CLASSES];
+
+static inline void PoolLock(struct Pool *pool)
+{
+    SpinLock(&pool->lock);
+}
+
+static inline void PoolUnlock(struct Pool *pool)
+{
+    SpinUnlock(&pool->lock);
+}
+
+// Hands the first `count` objects of the thread cache back to the global pool.
+static void PoolFlush(CFIndex cls, CFIndex count)
+{
+    struct PoolCache *cache = &PoolCaches[cls];
+    struct Pool *pool = &Pools[cls];
+    if(!count)
+        return;
+    struct PoolObject *first = cache->head;
+    struct PoolObject *last = first;
+    for(CFIndex i = 1; i < count; ++i)
+    {
+        last = last->next;
     }
+    cache->head = last->next;
+    cache->count -= count;
+    PoolLock(pool);
+    last->next = pool->head;
+    pool->head = first;
+    pool->count += count;
+    PoolUnlock(pool);
 }
 
-CFDateRef CFDateCreate(CFAllocatorRef allocator, CFAbsoluteTime at)
+#ifndef _WIN32
+static pthread_key_t PoolThreadKey;
+static _Thread_local Boolean PoolThreadRegistered;
+
+static void PoolThreadExit(void *arg)
 {
-    struct CFDate *date = malloc(sizeof(struct CFDate));
-    if(date)
+    // Destructors that run after this one may still free into the cache;
+    // registering again gets it flushed on the next destructor pass.
+    PoolThreadRegistered = false;
+    for(CFIndex cls = 0; cls < POOL_CLASSES; ++cls)
     {
-        date->type = kCFTypeDate;
-        date->refcnt = 1;
-        date->time = at;
+        PoolFlush(cls, PoolCaches[cls].count);
     }
-    return date;
 }
 
-CFAbsoluteTime CFDateGetAbsoluteTime(CFDateRef theDate)
+__attribute__((constructor)) static void PoolInit(void)
 {
-    return ((struct CFDate*)theDate)->time;
+    pthread_key_create(&PoolThreadKey, PoolThreadExit);
 }
+#endif
 
-CFMutableArrayRef CFArrayCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFArrayCallBacks *callBacks)
+// Gets the thread's cache flushed when it exits. Done on first use either way,
+// since a thread that only frees fills its cache without ever refilling it.
+static inline void PoolRegisterThread(void)
 {
-    struct CFArray *arr = malloc(sizeof(struct CFArray));
-    if(arr)
+#ifndef _WIN32
+    if(!PoolThreadRegistered)
     {
-        arr->type = kCFTypeArray;
-        arr->refcnt = 1;
-        arr->length = 0;
-        arr->capacity = capacity;
-        arr->callbacks = callBacks;
-        arr->elements = malloc(capacity * sizeof(*arr->elements));
-        if(!arr->elements)
-        {
-            free(arr);
-            arr = NULL;
-        }
+        PoolThreadRegistered = true;
+        pthread_setspecific(PoolThreadKey, PoolCaches);
     }
-    return arr;
+#endif
 }
 
-void CFArrayAppendValue(CFMutableArrayRef theArray, const void *value)
+static void PoolRefill(CFIndex cls)
 {
-    // TODO: thread safety
-    struct CFArray *arr = theArray;
-    if(arr->callbacks && arr->callbacks->retain)
+    struct PoolCache *cache = &PoolCaches[cls];
+    struct Pool *pool = &Pools[cls];
+    PoolLock(pool);
+    if(pool->head)
     {
-        arr->callbacks->retain(value);
+        struct PoolObject *first = pool->head;
+        struct PoolObject *last = first;
+        CFIndex count = 1;
+        while(count < POOL_BATCH && last->next)
+        {
+            last = last->next;
+            ++count;
+        }
+        pool->head = last->next;
+        pool->count -= count;
+        PoolUnlock(pool);
+        last->next = cache->head;
+        cache->head = first;
+        cache->count += count;
+        return;
     }
-    if(arr->length == arr->capacity)
+    PoolUnlock(pool);
+
+    CFIndex size = (cls + 1) * POOL_GRANULE;
+    uint8_t *slab = malloc(POOL_SLAB_SIZE);
+    if(!slab)
+        return;
+    __c11_atomic_fetch_add(&pool->slabs, 1, __ATOMIC_RELAXED);
+    for(CFIndex off = POOL_SLAB_SIZE / size * size; off > 0; off -= size)
     {
-        CFIndex newCapacity = arr->capacity * 2;
-        void *newElements = realloc(arr->elements, newCapacity * sizeof(*arr->elements));
-        if(!newElements)
-            abort();
-        arr->elements = newElements;
-        arr->capacity = newCapacity;
+        struct PoolObject *obj = (struct PoolObject*)(slab + off - size);
+        obj->next = cache->head;
+        cache->head = obj;
+        ++cache->count;
     }
-    arr->elements[arr->length++] = value;
 }
 
-CFIndex CFArrayGetCount(CFArrayRef theArray)
+static void* PoolAllocate(CFIndex cls)
 {
-    return ((const struct CFArray*)theArray)->length;
+    struct PoolCache *cache = &PoolCaches[cls];
+    struct Pool *pool = &Pools[cls];
+    __c11_atomic_fetch_add(&pool->allocations, 1, __ATOMIC_RELAXED);
+    PoolRegisterThread();
+    if(!cache->head)
+    {
+        __c11_atomic_fetch_add(&pool->misses, 1, __ATOMIC_RELAXED);
+        PoolRefill(cls);
+        if(!cache->head)
+            return NULL;
+    }
+    struct PoolObject *obj = cache->head;
+    cache->head = obj->next;
+    --cache->count;
+    return obj;
 }
 
-const void* CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx)
+static void PoolDeallocate(CFIndex cls, void *ptr)
 {
-    return ((const struct CFArray*)theArray)->elements[idx];
+    struct PoolCache *cache = &PoolCaches[cls];
+    struct PoolObject *obj = ptr;
+    __c11_atomic_fetch_add(&Pools[cls].frees, 1, __ATOMIC_RELAXED);
+    PoolRegisterThread();
+    obj->next = cache->head;
+    cache->head = obj;
+    if(++cache->count > 2 * POOL_BATCH)
+    {
+        PoolFlush(cls, POOL_BATCH);
+    }
 }
 
-void CFArrayApplyFunction(CFArrayRef theArray, CFRange range, CFArrayApplierFunction applier, void *context)
+CFIndex CFPoolGetStatistics(CFPoolStatistics *stats, CFIndex count)
 {
-    const struct CFArray *arr = theArray;
-    for(CFIndex i = range[0]; i < range[1]; ++i)
+    for(CFIndex cls = 0; cls < count && cls < POOL_CLASSES; ++cls)
     {
-        applier(arr->elements[i], context);
+        struct Pool *pool = &Pools[cls];
+        uint64_t allocations = __c11_atomic_load(&pool->allocations, __ATOMIC_RELAXED);
+        uint64_t misses = __c11_atomic_load(&pool->misses, __ATOMIC_RELAXED);
+        stats[cls].size = (cls + 1) * POOL_GRANULE;
+        stats[cls].allocations = allocations;
+        stats[cls].hits = allocations > misses ? allocations - misses : 0;
+        stats[cls].frees = __c11_atomic_load(&pool->frees, __ATOMIC_RELAXED);
+        stats[cls].slabs = __c11_atomic_load(&pool->slabs, __ATOMIC_RELAXED);
     }
+    return POOL_CLASSES;
 }
 
-CFMutableSetRef CFSetCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFSetCallBacks *callBacks)
+// Epoch-based reclamation for objects that readers use without taking a reference.
+// Readers announce the global epoch while inside a section; writers retire what they
+// unlinked, and it is released once the epoch has moved on twice, since by then
+// every reader that could have seen it has left its section. Retiring, leaving the
+// last section and tearing down a concurrent dictionary all try to move it on, so
+// nothing stays retired for long once readers are gone.
+struct EpochRecord
 {
-    struct CFArray *set = malloc(sizeof(struct CFArray));
-    if(set)
-    {
-        set->type = kCFTypeSet;
-        set->refcnt = 1;
-        set->length = 0;
-        set->capacity = capacity;
-        set->callbacks = callBacks;
-        set->elements = malloc(capacity * sizeof(*set->elements));
-        if(!set->elements)
-        {
-            free(set);
-            set = NULL;
-        }
-    }
-    return set;
+    _Atomic uint64_t epoch; // 0 outside of a section
+    _Atomic uint32_t used;
+    struct EpochRecord *next;
+    // Keeps the records of different threads on different cache lines.
+    char pad[128 - sizeof(uint64_t) - sizeof(uint32_t) - sizeof(void*)];
+};
+
+struct EpochRetired
+{
+    struct EpochRetired *next;
+    CFTypeRef cf;
+    uint64_t epoch;
+};
+
+static _Atomic uint64_t EpochGlobal = 1;
+static struct EpochRecord *_Atomic EpochRecords;
+static _Atomic uint32_t EpochLock;
+static struct EpochRetired *EpochRetiredList;
+static _Atomic CFIndex EpochPending;
+static _Thread_local struct EpochRecord *EpochSelf;
+static _Thread_local CFIndex EpochDepth;
+
+#ifndef _WIN32
+static pthread_key_t EpochThreadKey;
+
+static void EpochThreadExit(void *arg)
+{
+    struct EpochRecord *record = arg;
+    __c11_atomic_store(&record->epoch, 0, __ATOMIC_RELEASE);
+    __c11_atomic_store(&record->used, 0, __ATOMIC_RELEASE);
 }
 
-void CFSetAddValue(CFMutableSetRef theSet, const void *value)
+__attribute__((constructor)) static void EpochInit(void)
 {
-    // TODO: thread safety
-    struct CFArray *set = theSet;
-    Boolean (*equal)(const void*, const void*) = set->callbacks && set->callbacks->equal ? set->callbacks->equal : NullEqual;
-    for(CFIndex i = 0; i < set->length; ++i)
-    {
-        if(equal(set->elements[i], value))
-        {
-            return;
-        }
-    }
-    if(set->callbacks && set->callbacks->retain)
+    pthread_key_create(&EpochThreadKey, EpochThreadExit);
+}
+#endif
+
+static struct EpochRecord* EpochRegister(void)
+{
+    struct EpochRecord *record;
+    for(record = __c11_atomic_load(&EpochRecords, __ATOMIC_ACQUIRE); record; record = record->next)
     {
-        set->callbacks->retain(value);
+        uint32_t expected = 0;
+        if(__c11_atomic_compare_exchange_strong(&record->used, &expected, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
     }
-    if(set->length == set->capacity)
+    if(!record)
     {
-        CFIndex newCapacity = set->capacity * 2;
-        void *newElements = realloc(set->elements, newCapacity * sizeof(*set->elements));
-        if(!newElements)
+        record = calloc(1, sizeof(*record));
+        if(!record)
             abort();
-        set->elements = newElements;
-        set->capacity = newCapacity;
+        record->used = 1;
+        struct EpochRecord *head = __c11_atomic_load(&EpochRecords, __ATOMIC_RELAXED);
+        do
+        {
+            record->next = head;
+        } while(!__c11_atomic_compare_exchange_weak(&EpochRecords, &head, record, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
     }
-    set->elements[set->length++] = value;
+#ifndef _WIN32
+    pthread_setspecific(EpochThreadKey, record);
+#endif
+    EpochSelf = record;
+    return record;
 }
 
-CFIndex CFSetGetCount(CFSetRef theSet)
+void CFEpochEnter(void)
 {
-    return CFArrayGetCount(theSet);
+    if(EpochDepth++)
+        return;
+    struct EpochRecord *record = EpochSelf ? EpochSelf : EpochRegister();
+    __c11_atomic_store(&record->epoch, __c11_atomic_load(&EpochGlobal, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    // The announcement has to be visible before we read anything a writer may retire.
+    __c11_atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
-void CFSetGetValues(CFSetRef theSet, const void **values)
+static void EpochReclaim(Boolean wait);
+
+void CFEpochExit(void)
 {
-    const struct CFArray *set = theSet;
-    memcpy(values, set->elements, set->length * sizeof(*set->elements));
+    if(--EpochDepth)
+        return;
+    __c11_atomic_store(&EpochSelf->epoch, 0, __ATOMIC_RELEASE);
+    // This may have been the reader holding the epoch back. Readers leave often,
+    // so they don't wait for the lock if someone else is already at it.
+    if(__c11_atomic_load(&EpochPending, __ATOMIC_RELAXED))
+        EpochReclaim(false);
 }
 
-void CFSetApplyFunction(CFSetRef theSet, CFSetApplierFunction applier, void *context)
+// Moves the epoch forward if every reader in a section has seen the current one.
+// Called with EpochLock held.
+static uint64_t EpochAdvance(void)
 {
-    const struct CFArray *set = theSet;
-    for(CFIndex i = 0; i < set->length; ++i)
+    uint64_t epoch = __c11_atomic_load(&EpochGlobal, __ATOMIC_RELAXED);
+    __c11_atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(struct EpochRecord *record = __c11_atomic_load(&EpochRecords, __ATOMIC_ACQUIRE); record; record = record->next)
     {
-        applier(set->elements[i], context);
+        uint64_t seen = __c11_atomic_load(&record->epoch, __ATOMIC_ACQUIRE);
+        if(seen && seen != epoch)
+            return epoch;
     }
+    __c11_atomic_store(&EpochGlobal, epoch + 1, __ATOMIC_RELEASE);
+    return epoch + 1;
 }
 
-CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks)
+// Releases what no reader can be using anymore. Moves the epoch on twice, which
+// succeeds when no reader is inside a section that started before.
+static void EpochReclaim(Boolean wait)
 {
-    struct CFDictionary *dict = malloc(sizeof(struct CFDictionary));
-    if(dict)
+    if(wait)
+        SpinLock(&EpochLock);
+    else if(!SpinTryLock(&EpochLock))
+        return;
+    uint64_t epoch = EpochAdvance();
+    epoch = EpochAdvance();
+    struct EpochRetired *done = NULL;
+    CFIndex count = 0;
+    for(struct EpochRetired **link = &EpochRetiredList; *link; )
     {
-        dict->type = kCFTypeDictionary;
-        dict->refcnt = 1;
-        dict->length = 0;
-        dict->capacity = capacity;
-        dict->keyCallbacks = keyCallBacks;
-        dict->valueCallbacks = valueCallBacks;
-        dict->elements = malloc(capacity * sizeof(*dict->elements));
-        if(!dict->elements)
+        struct EpochRetired *cur = *link;
+        if(cur->epoch + 2 <= epoch)
         {
-            free(dict);
-            dict = NULL;
+            *link = cur->next;
+            cur->next = done;
+            done = cur;
+            ++count;
+        }
+        else
+        {
+            link = &cur->next;
         }
     }
-    return dict;
+    __c11_atomic_fetch_sub(&EpochPending, count, __ATOMIC_RELAXED);
+    SpinUnlock(&EpochLock);
+
+    while(done)
+    {
+        struct EpochRetired *next = done->next;
+        CFRelease(done->cf);
+        free(done);
+        done = next;
+    }
 }
 
-static void CFDictionaryEnterValue(CFMutableDictionaryRef theDict, const void *key, const void *value, bool addOnly)
+// Releases `cf` once no reader can still be using it. `cf` must already be unreachable.
+static void EpochRetire(CFTypeRef cf)
 {
-    // TODO: thread safety
-    struct CFDictionary *dict = theDict;
-    Boolean (*equal)(const void*, const void*) = dict->keyCallbacks && dict->keyCallbacks->equal ? dict->keyCallbacks->equal : NullEqual;
-    if(dict->valueCallbacks && dict->valueCallbacks->retain)
+    struct EpochRetired *item = malloc(sizeof(*item));
+    if(!item)
+        abort();
+    item->cf = cf;
+    __c11_atomic_thread_fence(__ATOMIC_SEQ_CST);
+    item->epoch = __c11_atomic_load(&EpochGlobal, __ATOMIC_RELAXED);
+
+    SpinLock(&EpochLock);
+    item->next = EpochRetiredList;
+    EpochRetiredList = item;
+    __c11_atomic_fetch_add(&EpochPending, 1, __ATOMIC_RELAXED);
+    SpinUnlock(&EpochLock);
+    EpochReclaim(true);
+}
+
+// Objects created on a thread with private refcounts enabled are counted with
+// plain loads and stores until they are handed to CFPublish.
+static _Thread_local Boolean PrivateRefcounts;
+
+// Allocates the header (and any inline payload) of a new object.
+// Fixed-size headers on the default allocator come from the slab pools.
+// Objects from an arena are immortal: they go away with the arena.
+static void* CFObjectCreate(CFAllocatorRef allocator, CFTypeID type, CFIndex size)
+{
+    struct CFBase *base;
+    if(!allocator && (type != kCFTypeString || size == sizeof(struct CFString)) && size <= POOL_MAX_SIZE)
     {
-        dict->valueCallbacks->retain(value);
+        CFIndex cls = (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+        base = PoolAllocate(cls);
+        if(!base)
+            return NULL;
+        base->flags = (cls + 1) << kCFObjectPoolShift;
+        __c11_atomic_store(&base->refcnt, 1, __ATOMIC_RELAXED);
     }
-    for(CFIndex i = 0; i < dict->length; ++i)
+    else if(!allocator)
+    {
+        base = malloc(size);
+        if(!base)
+            return NULL;
+        base->flags = 0;
+        __c11_atomic_store(&base->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    else
     {
-        if(equal(dict->elements[i].key, key))
+        uint8_t *mem = CFAllocatorAllocate(allocator, ALLOCATOR_PREFIX_SIZE + size, 0);
+        if(!mem)
+            return NULL;
+        base = (struct CFBase*)(mem + ALLOCATOR_PREFIX_SIZE);
+        base->flags = kCFObjectFlagAllocator;
+        if(AllocatorIsArena(allocator))
         {
-            if(!addOnly)
-            {
-                if(dict->valueCallbacks && dict->valueCallbacks->release)
-                {
-                    dict->valueCallbacks->release(dict->elements[i].value);
-                }
-                dict->elements[i].value = value;
-            }
-            return;
+            *(CFAllocatorRef*)mem = allocator;
+            __c11_atomic_store(&base->refcnt, 0xffffffff, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            *(CFAllocatorRef*)mem = (CFAllocatorRef)CFRetain(allocator);
+            __c11_atomic_store(&base->refcnt, 1, __ATOMIC_RELAXED);
         }
     }
-    if(dict->keyCallbacks && dict->keyCallbacks->retain)
+    if(PrivateRefcounts && __c11_atomic_load(&base->refcnt, __ATOMIC_RELAXED) != 0xffffffff)
+        base->flags |= kCFObjectFlagPrivate;
+    base->type = type;
+    MEMORY_ACCOUNT(base, 1, ObjectHeaderSize(type), size - ObjectHeaderSize(type));
+    return base;
+}
+
+CFAllocatorRef CFGetAllocator(CFTypeRef cf)
+{
+    const struct CFBase *base = cf;
+    if(CF_IS_TAGGED_OBJ(cf) || !(base->flags & kCFObjectFlagAllocator))
+        return kCFAllocatorDefault;
+    return *(CFAllocatorRef*)((uintptr_t)base - ALLOCATOR_PREFIX_SIZE);
+}
+
+static void CFObjectDestroy(struct CFBase *base)
+{
+    MEMORY_ACCOUNT(base, -1, -(int64_t)ObjectHeaderSize(base->type), -(int64_t)ObjectInlineSize(base));
+    if(base->flags & kCFObjectPoolMask)
     {
-        dict->keyCallbacks->retain(key);
+        PoolDeallocate(((base->flags & kCFObjectPoolMask) >> kCFObjectPoolShift) - 1, base);
+        return;
     }
-    if(dict->length == dict->capacity)
+    if(!(base->flags & kCFObjectFlagAllocator))
     {
-        CFIndex newCapacity = dict->capacity * 2;
-        void *newElements = realloc(dict->elements, newCapacity * sizeof(*dict->elements));
-        if(!newElements)
-            abort();
-        dict->elements = newElements;
-        dict->capacity = newCapacity;
+        free(base);
+        return;
     }
-    CFIndex idx = dict->length++;
-    dict->elements[idx].key = key;
-    dict->elements[idx].value = value;
+    CFAllocatorRef allocator = CFGetAllocator(base);
+    CFAllocatorDeallocate(allocator, (void*)((uintptr_t)base - ALLOCATOR_PREFIX_SIZE));
+    if(allocator)
+        CFRelease(allocator);
 }
 
-void CFDictionarySetValue(CFMutableDictionaryRef theDict, const void *key, const void *value)
+CFTypeID CFGetTypeID(CFTypeRef cf)
 {
-    CFDictionaryEnterValue(theDict, key, value, false);
+    if(CF_IS_TAGGED_OBJ(cf))
+        return CF_TAGGED_OBJ_TYPE(cf);
+    return (CFTypeID)((const struct CFBase*)cf)->type;
 }
 
-void CFDictionaryAddValue(CFMutableDictionaryRef theDict, const void *key, const void *value)
+// Borrowed bytes belong to an owner: an allocator (NULL being the default one)
+// deallocates them, any other object just has to be kept alive.
+static void DeallocateBorrowed(CFTypeRef owner, const void *bytes)
 {
-    CFDictionaryEnterValue(theDict, key, value, true);
+    if(!owner || CFGetTypeID(owner) == kCFTypeAllocator)
+        CFAllocatorDeallocate((CFAllocatorRef)owner, (void*)bytes);
 }
 
-CFIndex CFDictionaryGetCount(CFDictionaryRef theDict)
+// Returns the owner, whose reference the caller still has to drop.
+static CFTypeRef ReleaseBorrowed(const struct CFBase *base, size_t size, const void *bytes)
 {
-    return ((const struct CFDictionary*)theDict)->length;
+    CFTypeRef owner = *(const CFTypeRef*)((uintptr_t)base + size);
+    DeallocateBorrowed(owner, bytes);
+    return owner;
 }
 
-const void* CFDictionaryGetValue(CFDictionaryRef theDict, const void *key)
+// Editing a mutable owner can reallocate or free the bytes it lends out.
+static inline Boolean OwnerIsMutable(CFTypeRef owner)
 {
-    const struct CFDictionary *dict = theDict;
-    Boolean (*equal)(const void*, const void*) = dict->keyCallbacks && dict->keyCallbacks->equal ? dict->keyCallbacks->equal : NullEqual;
-    for(CFIndex i = 0; i < dict->length; ++i)
-    {
-        if(equal(dict->elements[i].key, key))
-        {
-            return dict->elements[i].value;
-        }
-    }
-    return NULL;
+    return owner && !CF_IS_TAGGED_OBJ(owner) && (((const struct CFBase*)owner)->flags & kCFObjectFlagMutable);
 }
 
-void CFDictionaryGetKeysAndValues(CFDictionaryRef theDict, const void **keys, const void **values)
+// Creates an object of `size` with room for the owner after it. Returns NULL on arenas,
+// whose objects never die and would keep the owner alive forever; callers copy instead.
+static void* BorrowedCreate(CFAllocatorRef allocator, CFTypeID type, size_t size, CFTypeRef owner)
 {
-    const struct CFDictionary *dict = theDict;
-    for(CFIndex i = 0; i < dict->length; ++i)
+    if(AllocatorIsArena(allocator))
+        return NULL;
+    struct CFBase *base = CFObjectCreate(allocator, type, size + sizeof(CFTypeRef));
+    if(base)
     {
-        if(keys)
-            keys[i] = dict->elements[i].key;
-        if(values)
-            values[i] = dict->elements[i].value;
+        base->flags |= kCFObjectFlagBorrowed;
+        *(CFTypeRef*)((uintptr_t)base + size) = owner ? CFRetain(owner) : NULL;
     }
+    return base;
 }
 
-void CFDictionaryApplyFunction(CFDictionaryRef theDict, CFDictionaryApplierFunction applier, void *context)
+// Define CF_REFCOUNT_CONTENTION to 1 to count shared refcount updates that lose
+// a race: each update then tries a single CAS first and falls back to fetch-add.
+#ifndef CF_REFCOUNT_CONTENTION
+#   define CF_REFCOUNT_CONTENTION 0
+#endif
+
+#if CF_REFCOUNT_CONTENTION
+static _Atomic uint64_t RefcountContention;
+#endif
+
+uint64_t CFRefcountGetContentionCount(void)
 {
-    const struct CFDictionary *dict = theDict;
-    for(CFIndex i = 0; i < dict->length; ++i)
-    {
-        applier(dict->elements[i].key, dict->elements[i].value, context);
-    }
+#if CF_REFCOUNT_CONTENTION
+    return __c11_atomic_load(&RefcountContention, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+static inline uint32_t RefcountAdd(struct CFBase *base, uint32_t oldval, int32_t delta, int order)
+{
+#if CF_REFCOUNT_CONTENTION
+    if(__c11_atomic_compare_exchange_weak(&base->refcnt, &oldval, oldval + delta, order, __ATOMIC_RELAXED))
+        return oldval;
+    __c11_atomic_fetch_add(&RefcountContention, 1, __ATOMIC_RELAXED);
+#endif
+    return __c11_atomic_fetch_add(&base->refcnt, delta, order);
+}
+
+void CFSetThreadPrivateRefcounts(Boolean enabled)
+{
+    PrivateRefcounts = enabled;
+}
+
+static void PublishApplier(const void *value, void *context)
+{
+    CFPublish(value);
+}
+
+static void PublishDictionaryApplier(const void *key, const void *value, void *context)
+{
+    CFPublish(key);
+    CFPublish(value);
+}
+
+// Makes a private tree safe to share. Descent stops at objects that are
+// already public, which are assumed to only hold public objects themselves.
+void CFPublish(CFTypeRef cf)
+{
+    if(CF_IS_TAGGED_OBJ(cf))
+        return;
+    struct CFBase *base = (struct CFBase*)cf;
+    if(!(base->flags & kCFObjectFlagPrivate))
+        return;
+    base->flags &= ~kCFObjectFlagPrivate;
+    switch(base->type)
+    {
+        case kCFTypeArray:
+            CFArrayApplyFunction(cf, CFRangeMake(0, CFArrayGetCount(cf)), PublishApplier, NULL);
+            break;
+        case kCFTypeSet:
+            CFSetApplyFunction(cf, PublishApplier, NULL);
+            break;
+        case kCFTypeDictionary:
+            CFDictionaryApplyFunction(cf, PublishDictionaryApplier, NULL);
+            break;
+        default:
+            break;
+    }
+    // Whoever receives the tree must see all of the above.
+    __c11_atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+CFTypeRef CFRetain(CFTypeRef cf)
+{
+    if(CF_IS_TAGGED_OBJ(cf))
+        return cf;
+    struct CFBase *base = (struct CFBase*)cf;
+    uint32_t oldval = __c11_atomic_load(&base->refcnt, __ATOMIC_RELAXED);
+    if(oldval == 0xffffffff)
+        return cf;
+    if(base->flags & kCFObjectFlagPrivate)
+        __c11_atomic_store(&base->refcnt, oldval + 1, __ATOMIC_RELAXED);
+    else
+        RefcountAdd(base, oldval, 1, __ATOMIC_RELAXED);
+    return cf;
+}
+
+// Drops one reference, returning whether it was the last one.
+static inline Boolean RefcountDrop(CFTypeRef cf)
+{
+    if(CF_IS_TAGGED_OBJ(cf))
+        return false;
+    struct CFBase *base = (struct CFBase*)cf;
+    uint32_t oldval = __c11_atomic_load(&base->refcnt, __ATOMIC_RELAXED);
+    if(oldval == 0xffffffff)
+        return false;
+    if(base->flags & kCFObjectFlagPrivate)
+    {
+        __c11_atomic_store(&base->refcnt, oldval - 1, __ATOMIC_RELAXED);
+        return oldval == 1;
+    }
+    oldval = RefcountAdd(base, oldval, -1, __ATOMIC_RELEASE);
+    if(oldval != 1)
+        return false;
+    // Pairs with the release above in the other threads' CFRelease.
+    __c11_atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return true;
+}
+
+// Dead objects whose contents still have to be released. Teardown walks it
+// instead of recursing, so that deep trees don't need a deep stack.
+#define TEARDOWN_LOCAL 64
+
+struct TeardownList
+{
+    struct CFBase **items;
+    CFIndex count;
+    CFIndex capacity;
+    struct CFBase *local[TEARDOWN_LOCAL];
+};
+
+static void TeardownPush(struct TeardownList *list, struct CFBase *base)
+{
+    if(list->count == list->capacity)
+    {
+        CFIndex capacity = GrowCapacity(list->capacity, list->count + 1, TEARDOWN_LOCAL);
+        struct CFBase **items = malloc(capacity * sizeof(*items));
+        if(!items)
+            abort();
+        memcpy(items, list->items, list->count * sizeof(*items));
+        if(list->items != list->local)
+            free(list->items);
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = base;
+}
+
+// The default callbacks are handled inline rather than called through, which also
+// keeps them from recursing. NULL is only ever passed for a borrowed buffer's owner.
+static inline void TeardownValue(struct TeardownList *list, void (*release)(const void*), const void *value)
+{
+    if(release == CFRelease)
+    {
+        if(value && RefcountDrop(value))
+            TeardownPush(list, (struct CFBase*)value);
+    }
+    else
+    {
+        release(value);
+    }
+}
+
+// Without a list, entries are released through their callbacks directly.
+static void HamtNodeRelease(const struct CFDictionary *dict, struct CFHamtNode *node, struct TeardownList *list)
+{
+    if(__c11_atomic_fetch_sub(&node->refcnt, 1, __ATOMIC_RELEASE) != 1)
+        return;
+    __c11_atomic_thread_fence(__ATOMIC_ACQUIRE);
+    void (*keyRelease)(const void*) = dict->keyCallbacks ? dict->keyCallbacks->release : NULL,
+         (*valueRelease)(const void*) = dict->valueCallbacks ? dict->valueCallbacks->release : NULL;
+    for(CFIndex i = 0; i < node->entries; ++i)
+    {
+        if(keyRelease)
+            list ? TeardownValue(list, keyRelease, node->slots[2 * i]) : keyRelease(node->slots[2 * i]);
+        if(valueRelease)
+            list ? TeardownValue(list, valueRelease, node->slots[2 * i + 1]) : valueRelease(node->slots[2 * i + 1]);
+    }
+    // Only as deep as the trie.
+    for(CFIndex i = 0; i < node->children; ++i)
+    {
+        HamtNodeRelease(dict, HamtChild(node, i), list);
+    }
+    MEMORY_ACCOUNT(dict, 0, 0, -(int64_t)HamtNodeSize(node->entries, node->children));
+    free(node);
+}
+
+static void TeardownContents(struct CFBase *base, struct TeardownList *list)
+{
+    CFAllocatorRef allocator = CFGetAllocator(base);
+    switch(base->type)
+    {
+        case kCFTypeString:
+        {
+            if(base->flags & kCFObjectFlagBorrowed)
+                TeardownValue(list, CFRelease, ReleaseBorrowed(base, sizeof(struct CFString), ((struct CFString*)base)->str));
+            break;
+        }
+        case kCFTypeData:
+        {
+            struct CFData *data = (struct CFData*)base;
+            if(base->flags & kCFObjectFlagBorrowed)
+                TeardownValue(list, CFRelease, ReleaseBorrowed(base, sizeof(struct CFData), data->bytes));
+            else
+                CFAllocatorDeallocate(allocator, data->bytes);
+            break;
+        }
+        case kCFTypeArray:
+        case kCFTypeSet:
+        {
+            struct CFArray *arr = (struct CFArray*)base;
+            if(arr->callbacks && arr->callbacks->release)
+            {
+                void (*release)(const void*) = arr->callbacks->release;
+                for(CFIndex i = 0; i < arr->length; ++i)
+                {
+                    TeardownValue(list, release, arr->elements[i]);
+                }
+            }
+            CFAllocatorDeallocate(allocator, arr->elements);
+            if(base->type == kCFTypeSet)
+            {
+                CFAllocatorDeallocate(allocator, ((struct CFSet*)base)->index.slots);
+            }
+            break;
+        }
+        case kCFTypeDictionary:
+        {
+            struct CFDictionary *dict = (struct CFDictionary*)base;
+            void (*keyRelease)(const void*) = dict->keyCallbacks ? dict->keyCallbacks->release : NULL,
+                 (*valueRelease)(const void*) = dict->valueCallbacks ? dict->valueCallbacks->release : NULL;
+            if((keyRelease || valueRelease) && !(base->flags & kCFDictionaryFlagPersistent))
+            {
+                for(CFIndex i = 0; i < dict->length; ++i)
+                {
+                    if(dict->elements[i].key == kRemovedKey)
+                        continue;
+                    if(keyRelease)
+                        TeardownValue(list, keyRelease, dict->elements[i].key);
+                    if(valueRelease)
+                        TeardownValue(list, valueRelease, dict->elements[i].value);
+                }
+            }
+            CFAllocatorDeallocate(allocator, dict->elements);
+            CFAllocatorDeallocate(allocator, dict->index.slots);
+            if(base->flags & kCFDictionaryFlagConcurrent)
+            {
+                TeardownValue(list, CFRelease, dict->snapshot);
+                // Earlier snapshots may still be waiting for the epoch to move on.
+                EpochReclaim(true);
+            }
+            if((base->flags & kCFDictionaryFlagPersistent) && dict->root)
+                HamtNodeRelease(dict, dict->root, list);
+            break;
+        }
+        case kCFTypeAllocator:
+        {
+            struct CFAllocator *alloc = (struct CFAllocator*)base;
+            if(alloc->flags & kCFAllocatorFlagArena)
+            {
+                struct CFArenaChunk *chunk = alloc->chunks;
+                while(chunk)
+                {
+                    struct CFArenaChunk *next = chunk->next;
+                    CFAllocatorDeallocate(allocator, chunk);
+                    chunk = next;
+                }
+            }
+            else if(alloc->context.release)
+            {
+                alloc->context.release(alloc->context.info);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void Teardown(struct CFBase *base)
+{
+    struct TeardownList list;
+    list.items = list.local;
+    list.count = 0;
+    list.capacity = TEARDOWN_LOCAL;
+    TeardownPush(&list, base);
+    while(list.count)
+    {
+        base = list.items[--list.count];
+        MEMORY_ACCOUNT(base, 0, 0, -(int64_t)ObjectBufferSize(base));
+        TeardownContents(base, &list);
+        CFObjectDestroy(base);
+    }
+    if(list.items != list.local)
+        free(list.items);
+}
+
+// Background reclamation: dead containers are queued for a dedicated thread,
+// so that releasing a large tree costs the releasing thread almost nothing.
+static _Atomic Boolean ReclaimEnabled;
+
+#ifndef _WIN32
+static pthread_mutex_t ReclaimMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ReclaimWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ReclaimIdle = PTHREAD_COND_INITIALIZER;
+static struct CFBase **ReclaimQueue;
+static CFIndex ReclaimCount;
+static CFIndex ReclaimCapacity;
+static Boolean ReclaimBusy;
+static Boolean ReclaimStarted;
+static _Thread_local Boolean ReclaimSelf;
+
+static void* ReclaimThread(void *arg)
+{
+    ReclaimSelf = true;
+    pthread_mutex_lock(&ReclaimMutex);
+    for(;;)
+    {
+        while(!ReclaimCount)
+        {
+            ReclaimBusy = false;
+            pthread_cond_broadcast(&ReclaimIdle);
+            pthread_cond_wait(&ReclaimWake, &ReclaimMutex);
+        }
+        ReclaimBusy = true;
+        struct CFBase **queue = ReclaimQueue;
+        CFIndex count = ReclaimCount;
+        ReclaimQueue = NULL;
+        ReclaimCount = 0;
+        ReclaimCapacity = 0;
+        pthread_mutex_unlock(&ReclaimMutex);
+        for(CFIndex i = 0; i < count; ++i)
+        {
+            Teardown(queue[i]);
+        }
+        free(queue);
+        pthread_mutex_lock(&ReclaimMutex);
+    }
+    return NULL;
+}
+
+static Boolean ReclaimEnqueue(struct CFBase *base)
+{
+    if(ReclaimSelf)
+        return false;
+    pthread_mutex_lock(&ReclaimMutex);
+    if(ReclaimCount == ReclaimCapacity)
+    {
+        CFIndex capacity = GrowCapacity(ReclaimCapacity, ReclaimCount + 1, TEARDOWN_LOCAL);
+        struct CFBase **queue = realloc(ReclaimQueue, capacity * sizeof(*queue));
+        if(!queue)
+        {
+            pthread_mutex_unlock(&ReclaimMutex);
+            return false;
+        }
+        ReclaimQueue = queue;
+        ReclaimCapacity = capacity;
+    }
+    ReclaimQueue[ReclaimCount++] = base;
+    pthread_cond_signal(&ReclaimWake);
+    pthread_mutex_unlock(&ReclaimMutex);
+    return true;
+}
+#endif
+
+// Disabling waits for everything queued so far to be freed.
+Boolean CFSetBackgroundReclamation(Boolean enabled)
+{
+#ifdef _WIN32
+    return false;
+#else
+    pthread_mutex_lock(&ReclaimMutex);
+    if(enabled && !ReclaimStarted)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, ReclaimThread, NULL) != 0)
+        {
+            pthread_mutex_unlock(&ReclaimMutex);
+            return false;
+        }
+        pthread_detach(thread);
+        ReclaimStarted = true;
+        ReclaimBusy = true;
+    }
+    __c11_atomic_store(&ReclaimEnabled, enabled, __ATOMIC_RELAXED);
+    if(!enabled)
+    {
+        while(ReclaimStarted && (ReclaimCount || ReclaimBusy))
+            pthread_cond_wait(&ReclaimIdle, &ReclaimMutex);
+    }
+    pthread_mutex_unlock(&ReclaimMutex);
+    return enabled;
+#endif
+}
+
+void CFRelease(CFTypeRef cf)
+{
+    if(!RefcountDrop(cf))
+        return;
+    struct CFBase *base = (struct CFBase*)cf;
+#ifndef _WIN32
+    // Private trees stay on their thread: their counts aren't atomic, and
+    // the reclaim thread would race with the owner on any shared children.
+    if(__c11_atomic_load(&ReclaimEnabled, __ATOMIC_RELAXED) && !(base->flags & kCFObjectFlagPrivate) &&
+       (base->type == kCFTypeArray || base->type == kCFTypeSet || base->type == kCFTypeDictionary) && ReclaimEnqueue(base))
+        return;
+#endif
+    Teardown(base);
+}
+
+// Expands a tagged number into `buf`, so that callers only deal with struct CFNumber.
+static inline const struct CFNumber* NumberResolve(CFNumberRef number, struct CFNumber *buf)
+{
+    if(!CF_IS_TAGGED_OBJ(number))
+        return number;
+    buf->numType = CF_TAGGED_NUMBER_TYPE(number);
+    buf->value.l = (long long)CF_TAGGED_NUMBER_VALUE(number);
+    return buf;
+}
+
+static Boolean DeepEqual(CFTypeRef cf1, CFTypeRef cf2, Boolean top);
+
+Boolean CFEqual(CFTypeRef cf1, CFTypeRef cf2)
+{
+    return DeepEqual(cf1, cf2, true);
+}
+
+static Boolean ScalarEqual(CFTypeRef cf1, CFTypeRef cf2, CFTypeID type)
+{
+    switch(type)
+    {
+        case kCFTypeString:
+        {
+            const struct CFString *str1 = cf1,
+                                  *str2 = cf2;
+            if(str1->length != str2->length)
+                return false;
+            CFHashCode hash1 = __c11_atomic_load(&str1->hash, __ATOMIC_RELAXED),
+                       hash2 = __c11_atomic_load(&str2->hash, __ATOMIC_RELAXED);
+            if(hash1 && hash2 && hash1 != hash2)
+                return false;
+            return memcmp(StringBytes(str1), StringBytes(str2), str1->length) == 0;
+        }
+        case kCFTypeData:
+        {
+            const struct CFData *dt1 = cf1,
+                                *dt2 = cf2;
+            return dt1->length == dt2->length && memcmp(dt1->bytes, dt2->bytes, dt1->length) == 0;
+        }
+        case kCFTypeNumber:
+        {
+            struct CFNumber buf1, buf2;
+            const struct CFNumber *num1 = NumberResolve(cf1, &buf1),
+                                  *num2 = NumberResolve(cf2, &buf2);
+            if(num1->numType != num2->numType)
+                return false;
+            switch(num1->numType)
+            {
+                case kCFNumberLongLongType:
+                    return num1->value.l == num2->value.l;
+                case kCFNumberDoubleType:
+                    return num1->value.d == num2->value.d;
+                default:
+                    return false;
+            }
+        }
+        case kCFTypeDate:
+            return ((const struct CFDate*)cf1)->time == ((const struct CFDate*)cf2)->time;
+        default:
+            return false;
+    }
+}
+
+// Cached hashes use 0 for "not computed yet".
+static inline CFHashCode HashCached(_Atomic CFHashCode *cache, const void *bytes, CFIndex length)
+{
+    CFHashCode hash = __c11_atomic_load(cache, __ATOMIC_RELAXED);
+    if(!hash)
+    {
+        hash = HashBytes(bytes, length);
+        if(!hash)
+            hash = 1;
+        __c11_atomic_store(cache, hash, __ATOMIC_RELAXED);
+    }
+    return hash;
+}
+
+CFHashCode CFHash(CFTypeRef cf)
+{
+    switch(CFGetTypeID(cf))
+    {
+        case kCFTypeNull:
+            return HashPointer(cf);
+        case kCFTypeBoolean:
+            return HashMix(CF_TAGGED_BOOLEAN_VALUE(cf) ^ HashSeed, HASH_SECRET1);
+        case kCFTypeString:
+        {
+            struct CFString *str = (struct CFString*)cf;
+            return HashCached(&str->hash, StringBytes(str), str->length);
+        }
+        case kCFTypeData:
+        {
+            struct CFData *data = (struct CFData*)cf;
+            return HashCached(&data->hash, data->bytes, data->length);
+        }
+        case kCFTypeNumber:
+        {
+            struct CFNumber buf;
+            const struct CFNumber *num = NumberResolve(cf, &buf);
+            uint64_t bits = num->value.l;
+            if(num->numType == kCFNumberDoubleType)
+            {
+                // 0.0 == -0.0
+                double d = num->value.d == 0 ? 0 : num->value.d;
+                memcpy(&bits, &d, sizeof(bits));
+            }
+            return HashMix(bits ^ HashSeed, HASH_SECRET1 ^ num->numType);
+        }
+        case kCFTypeDate:
+        {
+            uint64_t bits;
+            double t = ((const struct CFDate*)cf)->time == 0 ? 0 : ((const struct CFDate*)cf)->time;
+            memcpy(&bits, &t, sizeof(bits));
+            return HashMix(bits ^ HashSeed, HASH_SECRET2);
+        }
+        case kCFTypeArray:
+        case kCFTypeSet:
+        case kCFTypeDictionary:
+            return CFFingerprint(cf);
+        default:
+            return HashPointer(cf);
+    }
+}
+
+// Structural fingerprints: scalars use their CFHash, arrays combine their elements
+// in order, and sets and dictionaries add them up so that order doesn't matter.
+// Containers cache theirs once nothing below them can change anymore; every
+// mutator still resets the cache, in case one gets edited regardless.
+static inline Boolean FingerprintCacheable(const struct CFBase *base)
+{
+    return !(base->flags & kCFObjectFlagMutable) || (base->flags & kCFObjectFlagFrozen);
+}
+
+static inline _Atomic uint64_t* FingerprintCache(CFTypeRef cf)
+{
+    if(CFGetTypeID(cf) == kCFTypeDictionary)
+        return &((struct CFDictionary*)cf)->fingerprint;
+    // Sets share the array layout.
+    return &((struct CFArray*)cf)->fingerprint;
+}
+
+static uint64_t ValueFingerprint(CFTypeRef cf, Boolean *cacheable);
+
+// Matches the equality the container's callbacks use for its elements.
+static uint64_t ElementFingerprint(const struct CFCallbacks *callbacks, const void *value, Boolean *cacheable)
+{
+    if(!callbacks || !callbacks->equal)
+        return HashPointer(value);
+    if(callbacks->hash == CFHash)
+        return ValueFingerprint(value, cacheable);
+    return callbacks->hash ? callbacks->hash(value) : 0;
+}
+
+static uint64_t ContainerFingerprint(CFTypeRef cf, Boolean *cacheable)
+{
+    if(((const struct CFBase*)cf)->flags & kCFDictionaryFlagConcurrent)
+    {
+        CFEpochEnter();
+        uint64_t fp = ContainerFingerprint(DictionaryResolve(cf), cacheable);
+        CFEpochExit();
+        *cacheable = false;
+        return fp;
+    }
+    _Atomic uint64_t *cache = FingerprintCache(cf);
+    uint64_t fp = __c11_atomic_load(cache, __ATOMIC_RELAXED);
+    if(fp)
+        return fp;
+    Boolean mine = FingerprintCacheable(cf);
+    CFTypeID type = CFGetTypeID(cf);
+    CFIndex count;
+    if(type == kCFTypeDictionary)
+    {
+        const struct CFDictionary *dict = cf;
+        struct DictionaryIterator it;
+        const void *k, *v;
+        for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &k, &v); )
+        {
+            uint64_t key = ElementFingerprint(dict->keyCallbacks, k, &mine),
+                     value = ElementFingerprint(dict->valueCallbacks, v, &mine);
+            fp += HashMix(key ^ HashSeed, value ^ HASH_SECRET3);
+        }
+        count = dict->length - dict->removed;
+    }
+    else
+    {
+        const struct CFArray *arr = cf;
+        for(CFIndex i = 0; i < arr->length; ++i)
+        {
+            uint64_t value = ElementFingerprint(arr->callbacks, arr->elements[i], &mine);
+            if(type == kCFTypeArray)
+                fp = HashMix(fp ^ value ^ HashSeed, HASH_SECRET1);
+            else
+                fp += HashMix(value ^ HashSeed, HASH_SECRET2);
+        }
+        count = arr->length;
+    }
+    fp = HashMix(fp ^ count, HASH_SECRET0 ^ type);
+    if(!fp)
+        fp = 1;
+    if(mine)
+        __c11_atomic_store(cache, fp, __ATOMIC_RELAXED);
+    else
+        *cacheable = false;
+    return fp;
+}
+
+static uint64_t ValueFingerprint(CFTypeRef cf, Boolean *cacheable)
+{
+    switch(CFGetTypeID(cf))
+    {
+        case kCFTypeArray:
+        case kCFTypeSet:
+        case kCFTypeDictionary:
+            return ContainerFingerprint(cf, cacheable);
+        case kCFTypeData:
+            if(!FingerprintCacheable(cf))
+                *cacheable = false;
+            return CFHash(cf);
+        default:
+            return CFHash(cf);
+    }
+}
+
+uint64_t CFFingerprint(CFTypeRef cf)
+{
+    Boolean cacheable = true;
+    return ValueFingerprint(cf, &cacheable);
+}
+
+static Boolean ElementsEqual(const struct CFCallbacks *callbacks, const void *v1, const void *v2)
+{
+    if(v1 == v2)
+        return true;
+    if(!callbacks || !callbacks->equal)
+        return false;
+    if(callbacks->equal == CFEqual)
+        return DeepEqual(v1, v2, false);
+    return callbacks->equal(v1, v2);
+}
+
+// Containers are equal if they hold equal elements, in order for arrays.
+// The top-level call compares fingerprints up front, below that only cached ones
+// are used, so that mutable trees aren't hashed again at every level.
+static Boolean DeepEqual(CFTypeRef cf1, CFTypeRef cf2, Boolean top)
+{
+    if(cf1 == cf2)
+        return true;
+
+    CFTypeID type = CFGetTypeID(cf1);
+    if(type != CFGetTypeID(cf2))
+        return false;
+    if(type != kCFTypeArray && type != kCFTypeSet && type != kCFTypeDictionary)
+        return ScalarEqual(cf1, cf2, type);
+    if((((const struct CFBase*)cf1)->flags | ((const struct CFBase*)cf2)->flags) & kCFDictionaryFlagConcurrent)
+    {
+        CFEpochEnter();
+        Boolean equal = DeepEqual(DictionaryResolve(cf1), DictionaryResolve(cf2), top);
+        CFEpochExit();
+        return equal;
+    }
+
+    if(type == kCFTypeDictionary ? CFDictionaryGetCount(cf1) != CFDictionaryGetCount(cf2) : CFArrayGetCount(cf1) != CFArrayGetCount(cf2))
+        return false;
+    if(top)
+    {
+        if(CFFingerprint(cf1) != CFFingerprint(cf2))
+            return false;
+    }
+    else
+    {
+        uint64_t fp1 = __c11_atomic_load(FingerprintCache(cf1), __ATOMIC_RELAXED),
+                 fp2 = __c11_atomic_load(FingerprintCache(cf2), __ATOMIC_RELAXED);
+        if(fp1 && fp2 && fp1 != fp2)
+            return false;
+    }
+
+    switch(type)
+    {
+        case kCFTypeArray:
+        {
+            const struct CFArray *arr1 = cf1,
+                                 *arr2 = cf2;
+            for(CFIndex i = 0; i < arr1->length; ++i)
+            {
+                if(!ElementsEqual(arr1->callbacks, arr1->elements[i], arr2->elements[i]))
+                    return false;
+            }
+            return true;
+        }
+        case kCFTypeSet:
+        {
+            const struct CFSet *set1 = cf1;
+            for(CFIndex i = 0; i < set1->length; ++i)
+            {
+                if(!CFSetContainsValue(cf2, set1->elements[i]))
+                    return false;
+            }
+            return true;
+        }
+        default:
+        {
+            const struct CFDictionary *dict1 = cf1;
+            struct DictionaryIterator it;
+            const void *key, *value1, *value2;
+            for(DictionaryIteratorInit(&it, dict1); DictionaryNext(&it, &key, &value1); )
+            {
+                if(!CFDictionaryGetValueIfPresent(cf2, key, &value2))
+                    return false;
+                if(!ElementsEqual(dict1->valueCallbacks, value1, value2))
+                    return false;
+            }
+            return true;
+        }
+    }
+}
+
+Boolean CFBooleanGetValue(CFBooleanRef boolean)
+{
+    return CF_TAGGED_BOOLEAN_VALUE(boolean);
+}
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding)
+{
+    size_t len = strlen(cStr);
+    return CFStringCreateWithBytes(alloc, (const UInt8*)cStr, len, encoding, false);
+}
+
+static CFStringRef StringCreateBorrowed(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFTypeRef owner, Boolean terminated)
+{
+    // Short strings go inline and give the bytes back right away.
+    struct CFString *str = NULL;
+    if(numBytes >= sizeof(((struct CFString*)NULL)->inlineBytes))
+        str = BorrowedCreate(alloc, kCFTypeString, sizeof(struct CFString), owner);
+    if(!str)
+    {
+        CFStringRef copy = CFStringCreateWithBytes(alloc, bytes, numBytes, kCFStringEncodingUTF8, false);
+        if(copy)
+            DeallocateBorrowed(owner, bytes);
+        return copy;
+    }
+    if(!terminated)
+        str->flags |= kCFStringFlagUnterminated;
+    str->str = (const char*)bytes;
+    str->length = numBytes;
+    str->hash = 0;
+    return str;
+}
+
+CFStringRef CFStringCreateWithCStringNoCopy(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding, CFAllocatorRef contentsDeallocator)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+
+    return StringCreateBorrowed(alloc, (const UInt8*)cStr, strlen(cStr), contentsDeallocator, true);
+}
+
+CFStringRef CFStringCreateWithBytesNoCopy(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation, CFAllocatorRef contentsDeallocator)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+    if(isExternalRepresentation)
+        abort();
+
+    return StringCreateBorrowed(alloc, bytes, numBytes, contentsDeallocator, false);
+}
+
+CFStringRef CFStringCreateWithBytesOwner(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, CFTypeRef owner)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+
+    if(OwnerIsMutable(owner))
+        return CFStringCreateWithBytes(alloc, bytes, numBytes, encoding, false);
+    return StringCreateBorrowed(alloc, bytes, numBytes, owner ? owner : kCFAllocatorNull, false);
+}
+
+CFStringRef CFStringCreateWithFormat(CFAllocatorRef alloc, CFDictionaryRef formatOptions, CFStringRef format, ...)
+{
+    if(formatOptions != NULL)
+        abort();
+
+    va_list ap;
+    va_start(ap, format);
+    char *buf = NULL;
+    int r = vasprintf(&buf, StringBytes(format), ap);
+    va_end(ap);
+
+    if(r < 0)
+        return NULL;
+
+    CFStringRef str = CFStringCreateWithCString(alloc, buf, kCFStringEncodingUTF8);
+    free(buf);
+    return str;
+}
+
+CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+    if(isExternalRepresentation)
+        abort();
+
+    Boolean isInline = numBytes < sizeof(((struct CFString*)NULL)->inlineBytes);
+    struct CFString *str = CFObjectCreate(alloc, kCFTypeString, sizeof(struct CFString) + (isInline ? 0 : numBytes + 1));
+    if(str)
+    {
+        char *buf = isInline ? str->inlineBytes : (char*)(str + 1);
+        memcpy(buf, bytes, numBytes);
+        buf[numBytes] = '\0';
+        if(isInline)
+            str->flags |= kCFStringFlagInline;
+        else
+            str->str = buf;
+        str->length = numBytes;
+        str->hash = 0;
+    }
+    return str;
+}
+
+CFIndex CFStringGetLength(CFStringRef theString)
+{
+    return ((const struct CFString*)theString)->length;
+}
+
+// Compares bytewise, which for UTF-8 is code point order.
+CFComparisonResult CFStringCompare(CFStringRef theString1, CFStringRef theString2, CFOptionFlags compareOptions)
+{
+    if(compareOptions)
+        abort();
+
+    const struct CFString *str1 = theString1,
+                          *str2 = theString2;
+    int r = memcmp(StringBytes(str1), StringBytes(str2), str1->length < str2->length ? str1->length : str2->length);
+    if(!r)
+        return str1->length < str2->length ? kCFCompareLessThan : str1->length > str2->length ? kCFCompareGreaterThan : kCFCompareEqualTo;
+    return r < 0 ? kCFCompareLessThan : kCFCompareGreaterThan;
+}
+
+const char* CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding)
+{
+    if(encoding != kCFStringEncodingUTF8 || (((const struct CFString*)theString)->flags & kCFStringFlagUnterminated))
+        return NULL;
+
+    return StringBytes(theString);
+}
+
+CFIndex CFStringGetBytes(CFStringRef theString, CFRange range, CFStringEncoding encoding, UInt8 lossByte, Boolean isExternalRepresentation, UInt8 *buffer, CFIndex maxBufLen, CFIndex *usedBufLen)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+
+    if(range[1] <= range[0])
+    {
+        if(usedBufLen)
+            *usedBufLen = 0;
+        return 0;
+    }
+    CFIndex num = range[1] - range[0];
+    if(num > maxBufLen)
+        num = maxBufLen;
+    if(buffer)
+        memcpy(buffer, StringBytes(theString), num);
+    if(usedBufLen) *usedBufLen = num;
+    return num;
+}
+
+CFDataRef CFStringCreateExternalRepresentation(CFAllocatorRef alloc, CFStringRef theString, CFStringEncoding encoding, UInt8 lossByte)
+{
+    if(encoding != kCFStringEncodingUTF8)
+        abort();
+
+    return CFDataCreate(alloc, (const UInt8*)StringBytes(theString), CFStringGetLength(theString));
+}
+
+CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length)
+{
+    struct CFData *data = CFObjectCreate(allocator, kCFTypeData, sizeof(struct CFData));
+    if(data)
+    {
+        void *buf = CFAllocatorAllocate(allocator, length, 0);
+        if(buf)
+        {
+            memcpy(buf, bytes, length);
+            data->bytes = buf;
+            data->length = length;
+            data->capacity = length;
+            data->hash = 0;
+            MEMORY_ACCOUNT(data, 0, 0, length);
+        }
+        else
+        {
+            CFObjectDestroy((struct CFBase*)data);
+            data = NULL;
+        }
+    }
+    return data;
+}
+
+static CFDataRef DataCreateBorrowed(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, CFTypeRef owner)
+{
+    struct CFData *data = BorrowedCreate(allocator, kCFTypeData, sizeof(struct CFData), owner);
+    if(!data)
+    {
+        CFDataRef copy = CFDataCreate(allocator, bytes, length);
+        if(copy)
+            DeallocateBorrowed(owner, bytes);
+        return copy;
+    }
+    data->bytes = (void*)bytes;
+    data->length = length;
+    data->capacity = length;
+    data->hash = 0;
+    return data;
+}
+
+CFDataRef CFDataCreateWithBytesNoCopy(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, CFAllocatorRef bytesDeallocator)
+{
+    return DataCreateBorrowed(allocator, bytes, length, bytesDeallocator);
+}
+
+CFDataRef CFDataCreateWithBytesOwner(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, CFTypeRef owner)
+{
+    if(OwnerIsMutable(owner))
+        return CFDataCreate(allocator, bytes, length);
+    return DataCreateBorrowed(allocator, bytes, length, owner ? owner : kCFAllocatorNull);
+}
+
+#define DATA_MIN_CAPACITY 64
+
+static void DataSetCapacity(struct CFData *data, CFIndex capacity)
+{
+    MEMORY_ACCOUNT(data, 0, 0, (int64_t)capacity - (int64_t)data->capacity);
+    data->bytes = BufferSetCapacity(CFGetAllocator(data), data->bytes, data->capacity, capacity, 1);
+    data->capacity = capacity;
+}
+
+CFMutableDataRef CFDataCreateMutable(CFAllocatorRef allocator, CFIndex capacity)
+{
+    struct CFData *data = CFObjectCreate(allocator, kCFTypeData, sizeof(struct CFData));
+    if(data)
+    {
+        data->flags |= kCFObjectFlagMutable;
+        data->bytes = NULL;
+        data->length = 0;
+        data->capacity = capacity;
+        data->hash = 0;
+
+        if(capacity)
+        {
+            data->bytes = CFAllocatorAllocate(allocator, capacity, 0);
+            if(!data->bytes)
+            {
+                CFObjectDestroy((struct CFBase*)data);
+                data = NULL;
+            }
+            else
+            {
+                MEMORY_ACCOUNT(data, 0, 0, capacity);
+            }
+        }
+    }
+    return data;
+}
+
+void CFDataAppendBytes(CFMutableDataRef theData, const UInt8 *bytes, CFIndex length)
+{
+    // TODO: thread safety
+    if(!length)
+        return;
+
+    struct CFData *data = theData;
+    if(length > data->capacity - data->length)
+    {
+        DataSetCapacity(data, GrowCapacity(data->capacity, data->length + length, DATA_MIN_CAPACITY));
+    }
+    if(bytes)
+        memcpy((void*)((uintptr_t)data->bytes + data->length), bytes, length);
+    else
+        memset((void*)((uintptr_t)data->bytes + data->length), 0, length);
+    data->length += length;
+    data->hash = 0;
+}
+
+void CFDataIncreaseLength(CFMutableDataRef theData, CFIndex extraLength)
+{
+    CFDataAppendBytes(theData, NULL, extraLength);
+}
+
+void CFDataReserveCapacity(CFMutableDataRef theData, CFIndex capacity)
+{
+    struct CFData *data = theData;
+    if(capacity > data->capacity)
+    {
+        DataSetCapacity(data, capacity);
+    }
+}
+
+void CFDataShrinkToFit(CFMutableDataRef theData)
+{
+    struct CFData *data = theData;
+    if(data->capacity > data->length)
+    {
+        DataSetCapacity(data, data->length);
+    }
+}
+
+CFIndex CFDataGetLength(CFDataRef theData)
+{
+    return ((struct CFData*)theData)->length;
+}
+
+const UInt8* CFDataGetBytePtr(CFDataRef theData)
+{
+    return ((struct CFData*)theData)->bytes;
+}
+
+// Integers that survive the round trip through the pointer bits are tagged,
+// everything else gets a struct CFNumber.
+CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType theType, const void *valuePtr)
+{
+    struct CFNumber tmp;
+    switch(theType)
+    {
+#define MAPTYPE(enumtype, ctype, internaltype, field)       \
+        case enumtype:                                      \
+            tmp.value.field = *(const ctype*)valuePtr;      \
+            tmp.numType = internaltype;                     \
+            break;
+
+        MAPTYPE(kCFNumberSInt8Type,     int8_t,         kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt16Type,    int16_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt32Type,    int32_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt64Type,    int64_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberCharType,      char,           kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberIntType,       int,            kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberLongType,      long,           kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberLongLongType,  long long,      kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberCGFloatType,   CGFLOAT_TYPE,   kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloat32Type,   float,          kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloat64Type,   double,         kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloatType,     float,          kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberDoubleType,    double,         kCFNumberDoubleType,   d)
+
+#undef MAPTYPE
+
+        default:
+            abort();
+            break;
+    }
+    if(tmp.numType != kCFNumberDoubleType)
+    {
+        CFNumberRef tagged = CF_TAGGED_NUMBER(tmp.numType, (long long)tmp.value.l);
+        if(CF_TAGGED_NUMBER_VALUE(tagged) == (long long)tmp.value.l)
+            return tagged;
+    }
+    struct CFNumber *num = CFObjectCreate(allocator, kCFTypeNumber, sizeof(struct CFNumber));
+    if(num)
+    {
+        num->numType = tmp.numType;
+        num->value = tmp.value;
+    }
+    return num;
+}
+
+CFComparisonResult CFNumberCompare(CFNumberRef number, CFNumberRef otherNumber, void *context)
+{
+    struct CFNumber buf1, buf2;
+    const struct CFNumber *num1 = NumberResolve(number, &buf1),
+                          *num2 = NumberResolve(otherNumber, &buf2);
+    if(num1->numType == kCFNumberLongLongType && num2->numType == kCFNumberLongLongType)
+        return num1->value.l < num2->value.l ? kCFCompareLessThan : num1->value.l > num2->value.l ? kCFCompareGreaterThan : kCFCompareEqualTo;
+    double d1 = num1->numType == kCFNumberDoubleType ? num1->value.d : (double)num1->value.l,
+           d2 = num2->numType == kCFNumberDoubleType ? num2->value.d : (double)num2->value.l;
+    return d1 < d2 ? kCFCompareLessThan : d1 > d2 ? kCFCompareGreaterThan : kCFCompareEqualTo;
+}
+
+CFNumberType CFNumberGetType(CFNumberRef number)
+{
+    if(CF_IS_TAGGED_OBJ(number))
+        return CF_TAGGED_NUMBER_TYPE(number);
+    return ((const struct CFNumber*)number)->numType;
+}
+
+Boolean CFNumberIsFloatType(CFNumberRef number)
+{
+    return CFNumberGetType(number) == kCFNumberDoubleType;
+}
+
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr)
+{
+    struct CFNumber buf;
+    const struct CFNumber *num = NumberResolve(number, &buf);
+    switch(theType)
+    {
+#define MAPTYPE(enumtype, ctype, internaltype, field)       \
+        case enumtype:                                      \
+            if(num->numType != internaltype)                \
+                return false;                               \
+            *(ctype*)valuePtr = (ctype)num->value.field;    \
+            return true;
+
+        MAPTYPE(kCFNumberSInt8Type,     int8_t,         kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt16Type,    int16_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt32Type,    int32_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberSInt64Type,    int64_t,        kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberCharType,      char,           kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberIntType,       int,            kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberLongType,      long,           kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberLongLongType,  long long,      kCFNumberLongLongType, l)
+        MAPTYPE(kCFNumberCGFloatType,   CGFLOAT_TYPE,   kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloat32Type,   float,          kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloat64Type,   double,         kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberFloatType,     float,          kCFNumberDoubleType,   d)
+        MAPTYPE(kCFNumberDoubleType,    double,         kCFNumberDoubleType,   d)
+
+#undef MAPTYPE
+
+        default:
+            abort();
+            return false;
+    }
+}
+
+CFDateRef CFDateCreate(CFAllocatorRef allocator, CFAbsoluteTime at)
+{
+    struct CFDate *date = CFObjectCreate(allocator, kCFTypeDate, sizeof(struct CFDate));
+    if(date)
+    {
+        date->time = at;
+    }
+    return date;
+}
+
+CFAbsoluteTime CFDateGetAbsoluteTime(CFDateRef theDate)
+{
+    return ((struct CFDate*)theDate)->time;
+}
+
+CFMutableArrayRef CFArrayCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFArrayCallBacks *callBacks)
+{
+    struct CFArray *arr = CFObjectCreate(allocator, kCFTypeArray, sizeof(struct CFArray));
+    if(arr)
+    {
+        arr->flags |= kCFObjectFlagMutable;
+        arr->length = 0;
+        arr->capacity = capacity;
+        arr->callbacks = callBacks;
+        arr->fingerprint = 0;
+        arr->elements = CFAllocatorAllocate(allocator, capacity * sizeof(*arr->elements), 0);
+        if(!arr->elements)
+        {
+            CFObjectDestroy((struct CFBase*)arr);
+            arr = NULL;
+        }
+        else
+        {
+            MEMORY_ACCOUNT(arr, 0, 0, capacity * sizeof(*arr->elements));
+        }
+    }
+    return arr;
+}
+
+#define CONTAINER_MIN_CAPACITY 8
+
+static void ArraySetCapacity(struct CFArray *arr, CFIndex capacity)
+{
+    MEMORY_ACCOUNT(arr, 0, 0, ((int64_t)capacity - (int64_t)arr->capacity) * (int64_t)sizeof(*arr->elements));
+    arr->elements = BufferSetCapacity(CFGetAllocator(arr), arr->elements, arr->capacity, capacity, sizeof(*arr->elements));
+    arr->capacity = capacity;
+}
+
+void CFArrayAppendValue(CFMutableArrayRef theArray, const void *value)
+{
+    // TODO: thread safety
+    struct CFArray *arr = theArray;
+    arr->fingerprint = 0;
+    if(arr->callbacks && arr->callbacks->retain)
+    {
+        arr->callbacks->retain(value);
+    }
+    if(arr->length == arr->capacity)
+    {
+        ArraySetCapacity(arr, GrowCapacity(arr->capacity, arr->length + 1, CONTAINER_MIN_CAPACITY));
+    }
+    arr->elements[arr->length++] = value;
+}
+
+// Retains a batch of values, calling CFRetain directly for the common case.
+static void CallbacksRetainValues(const struct CFCallbacks *callbacks, const void **values, CFIndex count)
+{
+    if(!callbacks || !callbacks->retain)
+        return;
+    if(callbacks->retain == CFRetain)
+    {
+        for(CFIndex i = 0; i < count; ++i)
+        {
+            CFRetain(values[i]);
+        }
+    }
+    else
+    {
+        for(CFIndex i = 0; i < count; ++i)
+        {
+            callbacks->retain(values[i]);
+        }
+    }
+}
+
+CFMutableArrayRef CFArrayCreateMutableWithValues(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks)
+{
+    struct CFArray *arr = CFArrayCreateMutable(allocator, numValues, callBacks);
+    if(arr)
+    {
+        CallbacksRetainValues(callBacks, values, numValues);
+        memcpy(arr->elements, values, numValues * sizeof(*values));
+        arr->length = numValues;
+    }
+    return arr;
+}
+
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks)
+{
+    struct CFArray *arr = CFArrayCreateMutableWithValues(allocator, values, numValues, callBacks);
+    if(arr)
+        arr->flags &= ~kCFObjectFlagMutable;
+    return arr;
+}
+
+void CFArrayAppendArray(CFMutableArrayRef theArray, CFArrayRef otherArray, CFRange otherRange)
+{
+    struct CFArray *arr = theArray;
+    const struct CFArray *other = otherArray;
+    if(otherRange[1] <= otherRange[0])
+        return;
+    CFIndex count = otherRange[1] - otherRange[0];
+    arr->fingerprint = 0;
+    if(arr->capacity - arr->length < count)
+    {
+        ArraySetCapacity(arr, GrowCapacity(arr->capacity, arr->length + count, CONTAINER_MIN_CAPACITY));
+    }
+    // Appending an array to itself reads from the (possibly moved) elements after the resize.
+    const void **values = other->elements + otherRange[0];
+    CallbacksRetainValues(arr->callbacks, values, count);
+    memcpy(arr->elements + arr->length, values, count * sizeof(*values));
+    arr->length += count;
+}
+
+void CFArrayReserveCapacity(CFMutableArrayRef theArray, CFIndex capacity)
+{
+    struct CFArray *arr = theArray;
+    if(capacity > arr->capacity)
+    {
+        ArraySetCapacity(arr, capacity);
+    }
+}
+
+void CFArrayShrinkToFit(CFMutableArrayRef theArray)
+{
+    struct CFArray *arr = theArray;
+    if(arr->capacity > arr->length)
+    {
+        ArraySetCapacity(arr, arr->length);
+    }
+}
+
+void CFArrayGetValues(CFArrayRef theArray, CFRange range, const void **values)
+{
+    const struct CFArray *arr = theArray;
+    if(range[1] > range[0])
+        memcpy(values, arr->elements + range[0], (range[1] - range[0]) * sizeof(*values));
+}
+
+// Replaces the values in `range` with `newCount` new ones, moving the tail in place.
+// Insert, remove and set are all built on this.
+void CFArrayReplaceValues(CFMutableArrayRef theArray, CFRange range, const void **newValues, CFIndex newCount)
+{
+    struct CFArray *arr = theArray;
+    CFIndex oldCount = range[1] - range[0];
+    arr->fingerprint = 0;
+    // Retain first, the new values might be among the ones we release.
+    CallbacksRetainValues(arr->callbacks, newValues, newCount);
+    if(arr->callbacks && arr->callbacks->release)
+    {
+        void (*release)(const void*) = arr->callbacks->release;
+        for(CFIndex i = range[0]; i < range[1]; ++i)
+        {
+            release(arr->elements[i]);
+        }
+    }
+    if(newCount > oldCount && arr->capacity - arr->length < newCount - oldCount)
+    {
+        ArraySetCapacity(arr, GrowCapacity(arr->capacity, arr->length + newCount - oldCount, CONTAINER_MIN_CAPACITY));
+    }
+    if(newCount != oldCount)
+        memmove(arr->elements + range[0] + newCount, arr->elements + range[1], (arr->length - range[1]) * sizeof(*arr->elements));
+    if(newCount)
+        memcpy(arr->elements + range[0], newValues, newCount * sizeof(*newValues));
+    arr->length = arr->length - oldCount + newCount;
+}
+
+void CFArrayInsertValueAtIndex(CFMutableArrayRef theArray, CFIndex idx, const void *value)
+{
+    CFArrayReplaceValues(theArray, CFRangeMake(idx, idx), &value, 1);
+}
+
+void CFArraySetValueAtIndex(CFMutableArrayRef theArray, CFIndex idx, const void *value)
+{
+    CFArrayReplaceValues(theArray, CFRangeMake(idx, idx == CFArrayGetCount(theArray) ? idx : idx + 1), &value, 1);
+}
+
+void CFArrayRemoveValueAtIndex(CFMutableArrayRef theArray, CFIndex idx)
+{
+    CFArrayReplaceValues(theArray, CFRangeMake(idx, idx + 1), NULL, 0);
+}
+
+void CFArrayRemoveAllValues(CFMutableArrayRef theArray)
+{
+    CFArrayReplaceValues(theArray, CFRangeMake(0, CFArrayGetCount(theArray)), NULL, 0);
+}
+
+void CFArrayExchangeValuesAtIndices(CFMutableArrayRef theArray, CFIndex idx1, CFIndex idx2)
+{
+    struct CFArray *arr = theArray;
+    arr->fingerprint = 0;
+    const void *tmp = arr->elements[idx1];
+    arr->elements[idx1] = arr->elements[idx2];
+    arr->elements[idx2] = tmp;
+}
+
+// Introsort: quicksort with a median-of-three pivot, heapsort once the recursion
+// gets too deep, and insertion sort for short runs.
+#define SORT_INSERTION_THRESHOLD 16
+
+static void SortInsertion(const void **values, CFIndex count, CFComparatorFunction comparator, void *context)
+{
+    for(CFIndex i = 1; i < count; ++i)
+    {
+        const void *value = values[i];
+        CFIndex j = i;
+        for(; j > 0 && comparator(value, values[j - 1], context) < 0; --j)
+        {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+}
+
+static void SortSiftDown(const void **values, CFIndex root, CFIndex count, CFComparatorFunction comparator, void *context)
+{
+    const void *value = values[root];
+    for(CFIndex child; (child = 2 * root + 1) < count; root = child)
+    {
+        if(child + 1 < count && comparator(values[child], values[child + 1], context) < 0)
+            ++child;
+        if(comparator(value, values[child], context) >= 0)
+            break;
+        values[root] = values[child];
+    }
+    values[root] = value;
+}
+
+static void SortHeap(const void **values, CFIndex count, CFComparatorFunction comparator, void *context)
+{
+    for(CFIndex i = count / 2; i-- > 0; )
+    {
+        SortSiftDown(values, i, count, comparator, context);
+    }
+    for(CFIndex i = count; i-- > 1; )
+    {
+        const void *tmp = values[0];
+        values[0] = values[i];
+        values[i] = tmp;
+        SortSiftDown(values, 0, i, comparator, context);
+    }
+}
+
+static inline void SortSwap(const void **values, CFIndex a, CFIndex b)
+{
+    const void *tmp = values[a];
+    values[a] = values[b];
+    values[b] = tmp;
+}
+
+static void SortIntro(const void **values, CFIndex count, CFIndex depth, CFComparatorFunction comparator, void *context)
+{
+    while(count > SORT_INSERTION_THRESHOLD)
+    {
+        if(!depth--)
+        {
+            SortHeap(values, count, comparator, context);
+            return;
+        }
+        // Median of three ends up in values[0] and serves as the pivot.
+        CFIndex mid = count / 2, last = count - 1;
+        if(comparator(values[mid], values[0], context) < 0)
+            SortSwap(values, mid, 0);
+        if(comparator(values[last], values[mid], context) < 0)
+        {
+            SortSwap(values, last, mid);
+            if(comparator(values[mid], values[0], context) < 0)
+                SortSwap(values, mid, 0);
+        }
+        SortSwap(values, 0, mid);
+        const void *pivot = values[0];
+        CFIndex i = 0, j = count;
+        for(;;)
+        {
+            do ++i; while(i < count && comparator(values[i], pivot, context) < 0);
+            do --j; while(comparator(pivot, values[j], context) < 0);
+            if(i >= j)
+                break;
+            SortSwap(values, i, j);
+        }
+        SortSwap(values, 0, j);
+        // Recurse into the smaller half, loop on the larger one.
+        if(j < count - j - 1)
+        {
+            SortIntro(values, j, depth, comparator, context);
+            values += j + 1;
+            count -= j + 1;
+        }
+        else
+        {
+            SortIntro(values + j + 1, count - j - 1, depth, comparator, context);
+            count = j;
+        }
+    }
+    SortInsertion(values, count, comparator, context);
+}
+
+void CFArraySortValues(CFMutableArrayRef theArray, CFRange range, CFComparatorFunction comparator, void *context)
+{
+    struct CFArray *arr = theArray;
+    if(range[1] <= range[0])
+        return;
+    CFIndex count = range[1] - range[0];
+    arr->fingerprint = 0;
+    CFIndex depth = 0;
+    for(CFIndex n = count; n > 1; n >>= 1)
+    {
+        depth += 2;
+    }
+    SortIntro(arr->elements + range[0], count, depth, comparator, context);
+}
+
+// Returns the first index in `range` whose value isn't less than `value`,
+// which is where it would have to be inserted to keep the range sorted.
+CFIndex CFArrayBSearchValues(CFArrayRef theArray, CFRange range, const void *value, CFComparatorFunction comparator, void *context)
+{
+    const struct CFArray *arr = theArray;
+    CFIndex lo = range[0], hi = range[1];
+    while(lo < hi)
+    {
+        CFIndex mid = lo + (hi - lo) / 2;
+        if(comparator(arr->elements[mid], value, context) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+CFIndex CFArrayGetCount(CFArrayRef theArray)
+{
+    return ((const struct CFArray*)theArray)->length;
+}
+
+const void* CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx)
+{
+    return ((const struct CFArray*)theArray)->elements[idx];
+}
+
+void CFArrayApplyFunction(CFArrayRef theArray, CFRange range, CFArrayApplierFunction applier, void *context)
+{
+    const struct CFArray *arr = theArray;
+    for(CFIndex i = range[0]; i < range[1]; ++i)
+    {
+        applier(arr->elements[i], context);
+    }
+}
+
+#define kNotFound ((CFIndex)-1)
+
+#define HASH_GROUP_WIDTH      8
+#define HASH_CTRL_EMPTY       0x80
+#define HASH_CTRL_DELETED     0xfe
+#define HASH_INDEX_MIN_LENGTH 8
+#define HASH_GROUP_LSBS       0x0101010101010101ULL
+#define HASH_GROUP_MSBS       0x8080808080808080ULL
+
+static uint64_t HashKey(const struct CFCallbacks *callbacks, const void *key)
+{
+    // Without an equal callback, keys are compared by identity.
+    if(!callbacks || !callbacks->equal)
+        return HashPointer(key);
+    // Custom equality without a hash: everything collides, but lookups stay correct.
+    if(!callbacks->hash)
+        return 0;
+    return HashMix((uint64_t)callbacks->hash(key) ^ HashSeed, HASH_SECRET2);
+}
+
+static inline uint64_t HashIndexGroup(const uint8_t *ctrl)
+{
+    uint64_t group;
+    memcpy(&group, ctrl, sizeof(group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    group = __builtin_bswap64(group);
+#endif
+    return group;
+}
+
+// May report false positives after a true match; callers verify the key anyway.
+static inline uint64_t HashIndexMatch(uint64_t group, uint8_t h2)
+{
+    uint64_t x = group ^ (HASH_GROUP_LSBS * h2);
+    return (x - HASH_GROUP_LSBS) & ~x & HASH_GROUP_MSBS;
+}
+
+static inline uint64_t HashIndexMatchEmpty(uint64_t group)
+{
+    return group & ~(group << 6) & HASH_GROUP_MSBS;
+}
+
+static inline uint64_t HashIndexMatchFree(uint64_t group)
+{
+    return group & HASH_GROUP_MSBS;
+}
+
+static inline void HashIndexSetCtrl(struct CFHashIndex *index, CFIndex slot, uint8_t ctrl)
+{
+    index->ctrl[slot] = ctrl;
+    // The first group is mirrored past the end, so groups can be loaded from any bucket.
+    if(slot < HASH_GROUP_WIDTH)
+        index->ctrl[index->buckets + slot] = ctrl;
+}
+
+static inline const void* HashIndexKey(const void *keys, size_t stride, uint32_t idx)
+{
+    return *(const void**)((uintptr_t)keys + idx * stride);
+}
+
+static CFIndex HashIndexLookup(const struct CFHashIndex *index, uint64_t hash, const void *key, const void *keys, size_t stride, Boolean (*equal)(const void*, const void*))
+{
+    CFIndex mask = index->buckets - 1;
+    CFIndex pos = (CFIndex)(hash >> 7) & mask;
+    uint8_t h2 = hash & 0x7f;
+    for(CFIndex step = HASH_GROUP_WIDTH; ; step += HASH_GROUP_WIDTH)
+    {
+        uint64_t group = HashIndexGroup(index->ctrl + pos);
+        for(uint64_t match = HashIndexMatch(group, h2); match; match &= match - 1)
+        {
+            CFIndex slot = (pos + (__builtin_ctzll(match) >> 3)) & mask;
+            const void *k = HashIndexKey(keys, stride, index->slots[slot]);
+            if(k == key || (equal && equal(k, key)))
+                return slot;
+        }
+        if(HashIndexMatchEmpty(group))
+            return kNotFound;
+        pos = (pos + step) & mask;
+    }
+}
+
+static void HashIndexInsert(struct CFHashIndex *index, uint64_t hash, uint32_t idx)
+{
+    CFIndex mask = index->buckets - 1;
+    CFIndex pos = (CFIndex)(hash >> 7) & mask;
+    for(CFIndex step = HASH_GROUP_WIDTH; ; step += HASH_GROUP_WIDTH)
+    {
+        uint64_t match = HashIndexMatchFree(HashIndexGroup(index->ctrl + pos));
+        if(match)
+        {
+            CFIndex slot = (pos + (__builtin_ctzll(match) >> 3)) & mask;
+            HashIndexSetCtrl(index, slot, hash & 0x7f);
+            index->slots[slot] = idx;
+            return;
+        }
+        pos = (pos + step) & mask;
+    }
+}
+
+// Sizes the index so that it can never fill up before the elements array does,
+// then indexes the first `length` elements.
+static CFIndex HashIndexBuckets(CFIndex capacity)
+{
+    CFIndex buckets = 2 * HASH_GROUP_WIDTH;
+    while(buckets - buckets / 8 < capacity)
+    {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+static inline CFIndex HashIndexSize(CFIndex buckets)
+{
+    return buckets * sizeof(uint32_t) + buckets + HASH_GROUP_WIDTH;
+}
+
+static void HashIndexBuild(const struct CFBase *owner, struct CFHashIndex *index, CFIndex capacity, const void *keys, size_t stride, CFIndex length, const struct CFCallbacks *callbacks)
+{
+    CFIndex buckets = HashIndexBuckets(capacity);
+    if(buckets != index->buckets)
+    {
+        CFAllocatorRef allocator = CFGetAllocator(owner);
+        MEMORY_ACCOUNT(owner, 0, 0, (int64_t)HashIndexSize(buckets) - (index->slots ? (int64_t)HashIndexSize(index->buckets) : 0));
+        CFAllocatorDeallocate(allocator, index->slots);
+        index->slots = CFAllocatorAllocate(allocator, HashIndexSize(buckets), 0);
+        if(!index->slots)
+            abort();
+        index->ctrl = (uint8_t*)(index->slots + buckets);
+        index->buckets = buckets;
+    }
+    memset(index->ctrl, HASH_CTRL_EMPTY, buckets + HASH_GROUP_WIDTH);
+    for(CFIndex i = 0; i < length; ++i)
+    {
+        const void *key = HashIndexKey(keys, stride, i);
+        if(key != kRemovedKey)
+        {
+            HashIndexInsert(index, HashKey(callbacks, key), i);
+        }
+    }
+}
+
+CFMutableSetRef CFSetCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFSetCallBacks *callBacks)
+{
+    struct CFSet *set = CFObjectCreate(allocator, kCFTypeSet, sizeof(struct CFSet));
+    if(set)
+    {
+        set->flags |= kCFObjectFlagMutable;
+        set->length = 0;
+        set->capacity = capacity;
+        set->callbacks = callBacks;
+        set->fingerprint = 0;
+        set->index.slots = NULL;
+        set->index.ctrl = NULL;
+        set->index.buckets = 0;
+        set->elements = CFAllocatorAllocate(allocator, capacity * sizeof(*set->elements), 0);
+        if(!set->elements)
+        {
+            CFObjectDestroy((struct CFBase*)set);
+            set = NULL;
+        }
+        else
+        {
+            MEMORY_ACCOUNT(set, 0, 0, capacity * sizeof(*set->elements));
+        }
+    }
+    return set;
+}
+
+// Returns the position of `value` in the elements array, or kNotFound.
+// If the set is indexed, also returns the value's hash.
+static CFIndex CFSetFind(const struct CFSet *set, const void *value, uint64_t *hash)
+{
+    Boolean (*equal)(const void*, const void*) = set->callbacks ? set->callbacks->equal : NULL;
+    if(set->index.buckets)
+    {
+        *hash = HashKey(set->callbacks, value);
+        CFIndex slot = HashIndexLookup(&set->index, *hash, value, set->elements, sizeof(*set->elements), equal);
+        return slot == kNotFound ? kNotFound : set->index.slots[slot];
+    }
+    for(CFIndex i = 0; i < set->length; ++i)
+    {
+        const void *v = set->elements[i];
+        if(v == value || (equal && equal(v, value)))
+        {
+            return i;
+        }
+    }
+    return kNotFound;
+}
+
+static void CFSetReindex(struct CFSet *set)
+{
+    HashIndexBuild((struct CFBase*)set, &set->index, set->capacity, set->elements, sizeof(*set->elements), set->length, set->callbacks);
+}
+
+// The index is sized from the capacity, so it follows every resize.
+static void SetSetCapacity(struct CFSet *set, CFIndex capacity)
+{
+    MEMORY_ACCOUNT(set, 0, 0, ((int64_t)capacity - (int64_t)set->capacity) * (int64_t)sizeof(*set->elements));
+    set->elements = BufferSetCapacity(CFGetAllocator(set), set->elements, set->capacity, capacity, sizeof(*set->elements));
+    set->capacity = capacity;
+    if(set->index.buckets)
+    {
+        CFSetReindex(set);
+    }
+}
+
+void CFSetReserveCapacity(CFMutableSetRef theSet, CFIndex capacity)
+{
+    struct CFSet *set = theSet;
+    if(capacity > set->capacity)
+    {
+        SetSetCapacity(set, capacity);
+    }
+}
+
+void CFSetShrinkToFit(CFMutableSetRef theSet)
+{
+    struct CFSet *set = theSet;
+    if(set->capacity > set->length)
+    {
+        SetSetCapacity(set, set->length);
+    }
+}
+
+void CFSetAddValue(CFMutableSetRef theSet, const void *value)
+{
+    // TODO: thread safety
+    struct CFSet *set = theSet;
+    uint64_t hash = 0;
+    if(CFSetFind(set, value, &hash) != kNotFound)
+    {
+        return;
+    }
+    set->fingerprint = 0;
+    if(set->callbacks && set->callbacks->retain)
+    {
+        set->callbacks->retain(value);
+    }
+    if(set->length == set->capacity)
+    {
+        SetSetCapacity(set, GrowCapacity(set->capacity, set->length + 1, CONTAINER_MIN_CAPACITY));
+    }
+    CFIndex idx = set->length++;
+    set->elements[idx] = value;
+    if(set->index.buckets)
+    {
+        HashIndexInsert(&set->index, hash, idx);
+    }
+    else if(set->length > HASH_INDEX_MIN_LENGTH)
+    {
+        CFSetReindex(set);
+    }
+}
+
+CFMutableSetRef CFSetCreateMutableWithValues(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFSetCallBacks *callBacks)
+{
+    struct CFSet *set = CFSetCreateMutable(allocator, numValues, callBacks);
+    if(!set)
+        return NULL;
+    Boolean (*equal)(const void*, const void*) = callBacks ? callBacks->equal : NULL;
+    Boolean indexed = numValues > HASH_INDEX_MIN_LENGTH;
+    if(indexed)
+    {
+        HashIndexBuild((struct CFBase*)set, &set->index, numValues, set->elements, sizeof(*set->elements), 0, callBacks);
+    }
+    // Duplicates keep the first value, like CFSetAddValue.
+    for(CFIndex i = 0; i < numValues; ++i)
+    {
+        const void *value = values[i];
+        uint64_t hash = 0;
+        Boolean found = false;
+        if(indexed)
+        {
+            hash = HashKey(callBacks, value);
+            found = HashIndexLookup(&set->index, hash, value, set->elements, sizeof(*set->elements), equal) != kNotFound;
+        }
+        else
+        {
+            for(CFIndex j = 0; j < set->length && !found; ++j)
+            {
+                const void *v = set->elements[j];
+                found = v == value || (equal && equal(v, value));
+            }
+        }
+        if(found)
+            continue;
+        if(indexed)
+        {
+            HashIndexInsert(&set->index, hash, set->length);
+        }
+        set->elements[set->length++] = value;
+    }
+    CallbacksRetainValues(callBacks, set->elements, set->length);
+    return set;
+}
+
+CFSetRef CFSetCreate(CFAllocatorRef allocator, const void **values, CFIndex numValues, const CFSetCallBacks *callBacks)
+{
+    struct CFSet *set = CFSetCreateMutableWithValues(allocator, values, numValues, callBacks);
+    if(set)
+        set->flags &= ~kCFObjectFlagMutable;
+    return set;
+}
+
+CFIndex CFSetGetCount(CFSetRef theSet)
+{
+    return CFArrayGetCount(theSet);
+}
+
+Boolean CFSetContainsValue(CFSetRef theSet, const void *value)
+{
+    uint64_t hash;
+    return CFSetFind(theSet, value, &hash) != kNotFound;
+}
+
+const void* CFSetGetValue(CFSetRef theSet, const void *value)
+{
+    const struct CFSet *set = theSet;
+    uint64_t hash;
+    CFIndex i = CFSetFind(set, value, &hash);
+    return i == kNotFound ? NULL : set->elements[i];
+}
+
+void CFSetGetValues(CFSetRef theSet, const void **values)
+{
+    const struct CFSet *set = theSet;
+    memcpy(values, set->elements, set->length * sizeof(*set->elements));
+}
+
+void CFSetApplyFunction(CFSetRef theSet, CFSetApplierFunction applier, void *context)
+{
+    const struct CFSet *set = theSet;
+    for(CFIndex i = 0; i < set->length; ++i)
+    {
+        applier(set->elements[i], context);
+    }
+}
+
+struct InternKey
+{
+    const UInt8 *bytes;
+    CFIndex length;
+};
+
+static Boolean InternEqual(const void *value, const void *key)
+{
+    const struct InternKey *k = key;
+    const struct CFString *str = value;
+    return str->length == k->length && memcmp(StringBytes(str), k->bytes, k->length) == 0;
+}
+
+// `table` is a set with kCFTypeSetCallBacks, so that it can be searched by bytes
+// with the same hash CFHash would produce. New strings are created with the
+// table's allocator, since they may outlive the caller's.
+CFStringRef CFStringCreateWithBytesInterned(CFMutableSetRef table, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding)
+{
+    struct CFSet *set = table;
+    struct InternKey key = { bytes, numBytes };
+    CFHashCode hash = (CFHashCode)HashBytes(bytes, numBytes);
+    if(!hash)
+        hash = 1;
+    CFIndex idx = kNotFound;
+    if(set->index.buckets)
+    {
+        CFIndex slot = HashIndexLookup(&set->index, HashMix((uint64_t)hash ^ HashSeed, HASH_SECRET2), &key, set->elements, sizeof(*set->elements), InternEqual);
+        if(slot != kNotFound)
+            idx = set->index.slots[slot];
+    }
+    else
+    {
+        for(CFIndex i = 0; i < set->length; ++i)
+        {
+            if(InternEqual(set->elements[i], &key))
+            {
+                idx = i;
+                break;
+            }
+        }
+    }
+    if(idx != kNotFound)
+        return CFRetain(set->elements[idx]);
+
+    CFStringRef str = CFStringCreateWithBytes(CFGetAllocator(set), bytes, numBytes, encoding, false);
+    if(str)
+    {
+        CFSetAddValue(set, str);
+    }
+    return str;
+}
+
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks)
+{
+    struct CFDictionary *dict = CFObjectCreate(allocator, kCFTypeDictionary, sizeof(struct CFDictionary));
+    if(dict)
+    {
+        dict->flags |= kCFObjectFlagMutable;
+        dict->length = 0;
+        dict->capacity = capacity;
+        dict->removed = 0;
+        dict->keyCallbacks = keyCallBacks;
+        dict->valueCallbacks = valueCallBacks;
+        dict->fingerprint = 0;
+        dict->snapshot = NULL;
+        dict->root = NULL;
+        dict->index.slots = NULL;
+        dict->index.ctrl = NULL;
+        dict->index.buckets = 0;
+        dict->elements = CFAllocatorAllocate(allocator, capacity * sizeof(*dict->elements), 0);
+        if(!dict->elements)
+        {
+            CFObjectDestroy((struct CFBase*)dict);
+            dict = NULL;
+        }
+        else
+        {
+            MEMORY_ACCOUNT(dict, 0, 0, capacity * sizeof(*dict->elements));
+        }
+    }
+    return dict;
+}
+
+// Returns the position of `key` in the elements array, or kNotFound.
+// If the dictionary is indexed, also returns the key's hash and bucket.
+static CFIndex CFDictionaryFind(const struct CFDictionary *dict, const void *key, uint64_t *hash, CFIndex *slot)
+{
+    Boolean (*equal)(const void*, const void*) = dict->keyCallbacks ? dict->keyCallbacks->equal : NULL;
+    if(dict->index.buckets)
+    {
+        *hash = HashKey(dict->keyCallbacks, key);
+        *slot = HashIndexLookup(&dict->index, *hash, key, dict->elements, sizeof(*dict->elements), equal);
+        return *slot == kNotFound ? kNotFound : dict->index.slots[*slot];
+    }
+    for(CFIndex i = 0; i < dict->length; ++i)
+    {
+        const void *k = dict->elements[i].key;
+        if(k != kRemovedKey && (k == key || (equal && equal(k, key))))
+        {
+            return i;
+        }
+    }
+    return kNotFound;
+}
+
+static void CFDictionaryReindex(struct CFDictionary *dict)
+{
+    HashIndexBuild((struct CFBase*)dict, &dict->index, dict->capacity, dict->elements, sizeof(*dict->elements), dict->length, dict->keyCallbacks);
+}
+
+// Drops removed entries and resizes the elements array to `capacity`,
+// which must hold the remaining ones.
+static void DictionarySetCapacity(struct CFDictionary *dict, CFIndex capacity)
+{
+    if(dict->removed)
+    {
+        CFIndex j = 0;
+        for(CFIndex i = 0; i < dict->length; ++i)
+        {
+            if(dict->elements[i].key != kRemovedKey)
+            {
+                dict->elements[j++] = dict->elements[i];
+            }
+        }
+        dict->length = j;
+        dict->removed = 0;
+    }
+    if(capacity != dict->capacity)
+    {
+        MEMORY_ACCOUNT(dict, 0, 0, ((int64_t)capacity - (int64_t)dict->capacity) * (int64_t)sizeof(*dict->elements));
+        dict->elements = BufferSetCapacity(CFGetAllocator(dict), dict->elements, dict->capacity, capacity, sizeof(*dict->elements));
+        dict->capacity = capacity;
+    }
+    if(dict->index.buckets)
+    {
+        CFDictionaryReindex(dict);
+    }
+}
+
+// Called when the elements array is full: drops removed entries, and grows
+// the array unless that alone freed up enough room.
+static void CFDictionaryMakeRoom(struct CFDictionary *dict)
+{
+    CFIndex newCapacity = dict->capacity;
+    if(dict->removed <= dict->length / 2)
+    {
+        newCapacity = GrowCapacity(dict->capacity, dict->length - dict->removed + 1, CONTAINER_MIN_CAPACITY);
+    }
+    DictionarySetCapacity(dict, newCapacity);
+}
+
+void CFDictionaryReserveCapacity(CFMutableDictionaryRef theDict, CFIndex capacity)
+{
+    struct CFDictionary *dict = theDict;
+    // Snapshots are always exactly sized, tries have no elements array.
+    if(capacity > dict->capacity && !(dict->flags & (kCFDictionaryFlagConcurrent | kCFDictionaryFlagPersistent)))
+    {
+        DictionarySetCapacity(dict, capacity);
+    }
+}
+
+void CFDictionaryShrinkToFit(CFMutableDictionaryRef theDict)
+{
+    struct CFDictionary *dict = theDict;
+    if(dict->capacity > dict->length - dict->removed && !(dict->flags & (kCFDictionaryFlagConcurrent | kCFDictionaryFlagPersistent)))
+    {
+        DictionarySetCapacity(dict, dict->length - dict->removed);
+    }
+}
+
+static void DictionaryUpdateConcurrent(struct CFDictionary *dict, const void *key, const void *value, Boolean addOnly, Boolean remove);
+
+static void CFDictionaryEnterValue(CFMutableDictionaryRef theDict, const void *key, const void *value, bool addOnly)
+{
+    struct CFDictionary *dict = theDict;
+    if(dict->flags & kCFDictionaryFlagPersistent)
+        abort();
+    if(dict->flags & kCFDictionaryFlagConcurrent)
+    {
+        DictionaryUpdateConcurrent(dict, key, value, addOnly, false);
+        return;
+    }
+    dict->fingerprint = 0;
+    uint64_t hash = 0;
+    CFIndex slot = kNotFound;
+    CFIndex i = CFDictionaryFind(dict, key, &hash, &slot);
+    if(i != kNotFound)
+    {
+        if(!addOnly)
+        {
+            if(dict->valueCallbacks && dict->valueCallbacks->retain)
+            {
+                dict->valueCallbacks->retain(value);
+            }
+            if(dict->valueCallbacks && dict->valueCallbacks->release)
+            {
+                dict->valueCallbacks->release(dict->elements[i].value);
+            }
+            dict->elements[i].value = value;
+        }
+        return;
+    }
+    if(dict->keyCallbacks && dict->keyCallbacks->retain)
+    {
+        dict->keyCallbacks->retain(key);
+    }
+    if(dict->valueCallbacks && dict->valueCallbacks->retain)
+    {
+        dict->valueCallbacks->retain(value);
+    }
+    if(dict->length == dict->capacity)
+    {
+        CFDictionaryMakeRoom(dict);
+    }
+    CFIndex idx = dict->length++;
+    dict->elements[idx].key = key;
+    dict->elements[idx].value = value;
+    if(dict->index.buckets)
+    {
+        HashIndexInsert(&dict->index, hash, idx);
+    }
+    else if(dict->length - dict->removed > HASH_INDEX_MIN_LENGTH)
+    {
+        CFDictionaryReindex(dict);
+    }
+}
+
+CFMutableDictionaryRef CFDictionaryCreateMutableWithValues(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks)
+{
+    struct CFDictionary *dict = CFDictionaryCreateMutable(allocator, numValues, keyCallBacks, valueCallBacks);
+    if(!dict)
+        return NULL;
+    Boolean (*equal)(const void*, const void*) = keyCallBacks ? keyCallBacks->equal : NULL;
+    Boolean indexed = numValues > HASH_INDEX_MIN_LENGTH;
+    if(indexed)
+    {
+        HashIndexBuild((struct CFBase*)dict, &dict->index, numValues, dict->elements, sizeof(*dict->elements), 0, keyCallBacks);
+    }
+    // Duplicate keys keep the first key and the last value, like CFDictionarySetValue.
+    for(CFIndex i = 0; i < numValues; ++i)
+    {
+        const void *key = keys[i];
+        uint64_t hash = 0;
+        CFIndex idx = kNotFound;
+        if(indexed)
+        {
+            hash = HashKey(keyCallBacks, key);
+            CFIndex slot = HashIndexLookup(&dict->index, hash, key, dict->elements, sizeof(*dict->elements), equal);
+            if(slot != kNotFound)
+                idx = dict->index.slots[slot];
+        }
+        else
+        {
+            for(CFIndex j = 0; j < dict->length; ++j)
+            {
+                const void *k = dict->elements[j].key;
+                if(k == key || (equal && equal(k, key)))
+                {
+                    idx = j;
+                    break;
+                }
+            }
+        }
+        if(idx == kNotFound)
+        {
+            idx = dict->length++;
+            dict->elements[idx].key = key;
+            if(indexed)
+            {
+                HashIndexInsert(&dict->index, hash, idx);
+            }
+        }
+        dict->elements[idx].value = values[i];
+    }
+    for(CFIndex i = 0; i < dict->length; ++i)
+    {
+        CallbacksRetainValues(keyCallBacks, &dict->elements[i].key, 1);
+        CallbacksRetainValues(valueCallBacks, &dict->elements[i].value, 1);
+    }
+    return dict;
+}
+
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks)
+{
+    struct CFDictionary *dict = CFDictionaryCreateMutableWithValues(allocator, keys, values, numValues, keyCallBacks, valueCallBacks);
+    if(dict)
+        dict->flags &= ~kCFObjectFlagMutable;
+    return dict;
+}
+
+void CFDictionarySetValue(CFMutableDictionaryRef theDict, const void *key, const void *value)
+{
+    CFDictionaryEnterValue(theDict, key, value, false);
+}
+
+void CFDictionaryAddValue(CFMutableDictionaryRef theDict, const void *key, const void *value)
+{
+    CFDictionaryEnterValue(theDict, key, value, true);
+}
+
+void CFDictionaryRemoveValue(CFMutableDictionaryRef theDict, const void *key)
+{
+    struct CFDictionary *dict = theDict;
+    if(dict->flags & kCFDictionaryFlagPersistent)
+        abort();
+    if(dict->flags & kCFDictionaryFlagConcurrent)
+    {
+        DictionaryUpdateConcurrent(dict, key, NULL, false, true);
+        return;
+    }
+    uint64_t hash = 0;
+    CFIndex slot = kNotFound;
+    CFIndex i = CFDictionaryFind(dict, key, &hash, &slot);
+    if(i == kNotFound)
+        return;
+
+    dict->fingerprint = 0;
+    const void *oldKey = dict->elements[i].key;
+    const void *oldValue = dict->elements[i].value;
+    // Entries are tombstoned rather than moved so iteration keeps insertion order.
+    dict->elements[i].key = kRemovedKey;
+    dict->elements[i].value = NULL;
+    dict->removed++;
+    if(slot != kNotFound)
+    {
+        HashIndexSetCtrl(&dict->index, slot, HASH_CTRL_DELETED);
+    }
+    if(dict->keyCallbacks && dict->keyCallbacks->release)
+    {
+        dict->keyCallbacks->release(oldKey);
+    }
+    if(dict->valueCallbacks && dict->valueCallbacks->release)
+    {
+        dict->valueCallbacks->release(oldValue);
+    }
+}
+
+static inline CFIndex HamtFragment(uint64_t hash, CFIndex depth)
+{
+    return (hash >> (depth * HAMT_BITS)) & ((1 << HAMT_BITS) - 1);
+}
+
+static inline Boolean HamtKeysEqual(const struct CFDictionary *dict, const void *k1, const void *k2)
+{
+    return k1 == k2 || (dict->keyCallbacks && dict->keyCallbacks->equal && dict->keyCallbacks->equal(k1, k2));
+}
+
+// Returns the key/value pair of `key` in the trie, or NULL.
+static const void* const* HamtFind(const struct CFDictionary *dict, const void *key)
+{
+    const struct CFHamtNode *node = dict->root;
+    uint64_t hash = HashKey(dict->keyCallbacks, key);
+    for(CFIndex depth = 0; node; ++depth)
+    {
+        if(depth == HAMT_MAX_DEPTH)
+        {
+            for(CFIndex i = 0; i < node->entries; ++i)
+            {
+                if(HamtKeysEqual(dict, node->slots[2 * i], key))
+                    return &node->slots[2 * i];
+            }
+            return NULL;
+        }
+        uint32_t bit = 1u << HamtFragment(hash, depth);
+        if(node->dataMap & bit)
+        {
+            CFIndex i = __builtin_popcount(node->dataMap & (bit - 1));
+            return HamtKeysEqual(dict, node->slots[2 * i], key) ? &node->slots[2 * i] : NULL;
+        }
+        if(!(node->nodeMap & bit))
+            return NULL;
+        node = HamtChild(node, __builtin_popcount(node->nodeMap & (bit - 1)));
+    }
+    return NULL;
+}
+
+static struct CFHamtNode* HamtNodeCreate(struct CFDictionary *owner, CFIndex entries, CFIndex children, uint32_t dataMap, uint32_t nodeMap)
+{
+    CFIndex size = HamtNodeSize(entries, children);
+    struct CFHamtNode *node = malloc(size);
+    if(!node)
+        abort();
+    __c11_atomic_store(&node->refcnt, 1, __ATOMIC_RELAXED);
+    node->entries = entries;
+    node->children = children;
+    node->dataMap = dataMap;
+    node->nodeMap = nodeMap;
+    MEMORY_ACCOUNT(owner, 0, 0, size);
+    return node;
+}
+
+// A new node shares everything it holds with the node it was derived from, so
+// its contents get retained once it is filled in. Callers then drop their own
+// reference to any child they created for it.
+static void HamtNodeRetainContents(struct CFDictionary *owner, struct CFHamtNode *node)
+{
+    for(CFIndex i = 0; i < node->entries; ++i)
+    {
+        CallbacksRetainValues(owner->keyCallbacks, &node->slots[2 * i], 1);
+        CallbacksRetainValues(owner->valueCallbacks, &node->slots[2 * i + 1], 1);
+    }
+    for(CFIndex i = 0; i < node->children; ++i)
+    {
+        __c11_atomic_fetch_add(&HamtChild(node, i)->refcnt, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void HamtNodeDrop(struct CFHamtNode *node)
+{
+    __c11_atomic_fetch_sub(&node->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+// Node holding two entries whose hashes agree up to `depth`.
+static struct CFHamtNode* HamtPair(struct CFDictionary *owner, CFIndex depth, const void *k1, const void *v1, uint64_t h1, const void *k2, const void *v2, uint64_t h2)
+{
+    struct CFHamtNode *node;
+    if(depth == HAMT_MAX_DEPTH)
+    {
+        node = HamtNodeCreate(owner, 2, 0, 0, 0);
+        node->slots[0] = k1;
+        node->slots[1] = v1;
+        node->slots[2] = k2;
+        node->slots[3] = v2;
+        HamtNodeRetainContents(owner, node);
+        return node;
+    }
+    CFIndex f1 = HamtFragment(h1, depth),
+            f2 = HamtFragment(h2, depth);
+    if(f1 == f2)
+    {
+        struct CFHamtNode *child = HamtPair(owner, depth + 1, k1, v1, h1, k2, v2, h2);
+        node = HamtNodeCreate(owner, 0, 1, 0, 1u << f1);
+        node->slots[0] = child;
+        HamtNodeRetainContents(owner, node);
+        HamtNodeDrop(child);
+        return node;
+    }
+    node = HamtNodeCreate(owner, 2, 0, (1u << f1) | (1u << f2), 0);
+    if(f1 > f2)
+    {
+        node->slots[0] = k2;
+        node->slots[1] = v2;
+        node->slots[2] = k1;
+        node->slots[3] = v1;
+    }
+    else
+    {
+        node->slots[0] = k1;
+        node->slots[1] = v1;
+        node->slots[2] = k2;
+        node->slots[3] = v2;
+    }
+    HamtNodeRetainContents(owner, node);
+    return node;
+}
+
+// Copies `node`'s entries and children into `copy`, leaving out the entry `skipEntry`
+// and the child `skipChild`, and leaving a gap at `gapEntry` and `gapChild` instead.
+// Any of them can be kNotFound.
+static void HamtNodeCopySlots(struct CFHamtNode *copy, const struct CFHamtNode *node, CFIndex skipEntry, CFIndex gapEntry, CFIndex skipChild, CFIndex gapChild)
+{
+    CFIndex j = 0;
+    for(CFIndex i = 0; i < node->entries; ++i)
+    {
+        if(j == gapEntry)
+            ++j;
+        if(i == skipEntry)
+            continue;
+        copy->slots[2 * j] = node->slots[2 * i];
+        copy->slots[2 * j + 1] = node->slots[2 * i + 1];
+        ++j;
+    }
+    const void **children = &copy->slots[2 * copy->entries];
+    j = 0;
+    for(CFIndex i = 0; i < node->children; ++i)
+    {
+        if(j == gapChild)
+            ++j;
+        if(i == skipChild)
+            continue;
+        children[j++] = HamtChild(node, i);
+    }
+}
+
+// Returns a new version of `node` (which may be NULL) with `key` set to `value`.
+static struct CFHamtNode* HamtSet(struct CFDictionary *owner, const struct CFHamtNode *node, CFIndex depth, uint64_t hash, const void *key, const void *value, Boolean *added)
+{
+    struct CFHamtNode *copy;
+    if(depth == HAMT_MAX_DEPTH)
+    {
+        CFIndex i = 0;
+        while(i < node->entries && !HamtKeysEqual(owner, node->slots[2 * i], key))
+        {
+            ++i;
+        }
+        *added = i == node->entries;
+        copy = HamtNodeCreate(owner, node->entries + *added, 0, 0, 0);
+        HamtNodeCopySlots(copy, node, i, i, kNotFound, kNotFound);
+        copy->slots[2 * i] = key;
+        copy->slots[2 * i + 1] = value;
+        HamtNodeRetainContents(owner, copy);
+        return copy;
+    }
+    uint32_t bit = 1u << HamtFragment(hash, depth);
+    if(!node)
+    {
+        copy = HamtNodeCreate(owner, 1, 0, bit, 0);
+        copy->slots[0] = key;
+        copy->slots[1] = value;
+        HamtNodeRetainContents(owner, copy);
+        *added = true;
+        return copy;
+    }
+    CFIndex entry = __builtin_popcount(node->dataMap & (bit - 1)),
+            child = __builtin_popcount(node->nodeMap & (bit - 1));
+    if(node->dataMap & bit)
+    {
+        const void *k = node->slots[2 * entry];
+        if(HamtKeysEqual(owner, k, key))
+        {
+            copy = HamtNodeCreate(owner, node->entries, node->children, node->dataMap, node->nodeMap);
+            HamtNodeCopySlots(copy, node, entry, entry, kNotFound, kNotFound);
+            copy->slots[2 * entry] = key;
+            copy->slots[2 * entry + 1] = value;
+            HamtNodeRetainContents(owner, copy);
+            *added = false;
+            return copy;
+        }
+        // Both keys move down into a new child.
+        struct CFHamtNode *sub = HamtPair(owner, depth + 1, k, node->slots[2 * entry + 1], HashKey(owner->keyCallbacks, k), key, value, hash);
+        copy = HamtNodeCreate(owner, node->entries - 1, node->children + 1, node->dataMap & ~bit, node->nodeMap | bit);
+        HamtNodeCopySlots(copy, node, entry, kNotFound, kNotFound, child);
+        copy->slots[2 * copy->entries + child] = sub;
+        HamtNodeRetainContents(owner, copy);
+        HamtNodeDrop(sub);
+        *added = true;
+        return copy;
+    }
+    if(node->nodeMap & bit)
+    {
+        struct CFHamtNode *sub = HamtSet(owner, HamtChild(node, child), depth + 1, hash, key, value, added);
+        copy = HamtNodeCreate(owner, node->entries, node->children, node->dataMap, node->nodeMap);
+        HamtNodeCopySlots(copy, node, kNotFound, kNotFound, child, child);
+        copy->slots[2 * copy->entries + child] = sub;
+        HamtNodeRetainContents(owner, copy);
+        HamtNodeDrop(sub);
+        return copy;
+    }
+    copy = HamtNodeCreate(owner, node->entries + 1, node->children, node->dataMap | bit, node->nodeMap);
+    HamtNodeCopySlots(copy, node, kNotFound, entry, kNotFound, kNotFound);
+    copy->slots[2 * entry] = key;
+    copy->slots[2 * entry + 1] = value;
+    HamtNodeRetainContents(owner, copy);
+    *added = true;
+    return copy;
+}
+
+// Returns a new version of `node` without `key`, which must be present, or NULL if
+// nothing is left. A child left with a single entry is folded back into its parent.
+static struct CFHamtNode* HamtRemove(struct CFDictionary *owner, const struct CFHamtNode *node, CFIndex depth, uint64_t hash, const void *key)
+{
+    struct CFHamtNode *copy;
+    if(depth == HAMT_MAX_DEPTH)
+    {
+        CFIndex i = 0;
+        while(!HamtKeysEqual(owner, node->slots[2 * i], key))
+        {
+            ++i;
+        }
+        if(node->entries == 1)
+            return NULL;
+        copy = HamtNodeCreate(owner, node->entries - 1, 0, 0, 0);
+        HamtNodeCopySlots(copy, node, i, kNotFound, kNotFound, kNotFound);
+        HamtNodeRetainContents(owner, copy);
+        return copy;
+    }
+    uint32_t bit = 1u << HamtFragment(hash, depth);
+    CFIndex entry = __builtin_popcount(node->dataMap & (bit - 1)),
+            child = __builtin_popcount(node->nodeMap & (bit - 1));
+    if(node->dataMap & bit)
+    {
+        if(node->entries == 1 && !node->children)
+            return NULL;
+        copy = HamtNodeCreate(owner, node->entries - 1, node->children, node->dataMap & ~bit, node->nodeMap);
+        HamtNodeCopySlots(copy, node, entry, kNotFound, kNotFound, kNotFound);
+        HamtNodeRetainContents(owner, copy);
+        return copy;
+    }
+    struct CFHamtNode *sub = HamtRemove(owner, HamtChild(node, child), depth + 1, hash, key);
+    if(!sub)
+    {
+        if(!node->entries && node->children == 1)
+            return NULL;
+        copy = HamtNodeCreate(owner, node->entries, node->children - 1, node->dataMap, node->nodeMap & ~bit);
+        HamtNodeCopySlots(copy, node, kNotFound, kNotFound, child, kNotFound);
+        HamtNodeRetainContents(owner, copy);
+        return copy;
+    }
+    if(sub->entries == 1 && !sub->children)
+    {
+        copy = HamtNodeCreate(owner, node->entries + 1, node->children - 1, node->dataMap | bit, node->nodeMap & ~bit);
+        HamtNodeCopySlots(copy, node, kNotFound, entry, child, kNotFound);
+        copy->slots[2 * entry] = sub->slots[0];
+        copy->slots[2 * entry + 1] = sub->slots[1];
+        HamtNodeRetainContents(owner, copy);
+        HamtNodeRelease(owner, sub, NULL);
+        return copy;
+    }
+    copy = HamtNodeCreate(owner, node->entries, node->children, node->dataMap, node->nodeMap);
+    HamtNodeCopySlots(copy, node, kNotFound, kNotFound, child, child);
+    copy->slots[2 * copy->entries + child] = sub;
+    HamtNodeRetainContents(owner, copy);
+    HamtNodeDrop(sub);
+    return copy;
+}
+
+CFIndex CFDictionaryGetCount(CFDictionaryRef theDict)
+{
+    const struct CFDictionary *dict = DictionaryReadBegin(theDict);
+    CFIndex count = dict->length - dict->removed;
+    DictionaryReadEnd(theDict);
+    return count;
+}
+
+const void* CFDictionaryGetValue(CFDictionaryRef theDict, const void *key)
+{
+    const void *value = NULL;
+    CFDictionaryGetValueIfPresent(theDict, key, &value);
+    return value;
+}
+
+Boolean CFDictionaryGetValueIfPresent(CFDictionaryRef theDict, const void *key, const void **value)
+{
+    const struct CFDictionary *dict = DictionaryReadBegin(theDict);
+    Boolean found;
+    if(dict->flags & kCFDictionaryFlagPersistent)
+    {
+        const void *const *entry = HamtFind(dict, key);
+        found = entry != NULL;
+        if(found && value)
+            *value = entry[1];
+    }
+    else
+    {
+        uint64_t hash;
+        CFIndex slot;
+        CFIndex i = CFDictionaryFind(dict, key, &hash, &slot);
+        found = i != kNotFound;
+        if(found && value)
+            *value = dict->elements[i].value;
+    }
+    DictionaryReadEnd(theDict);
+    return found;
+}
+
+void CFDictionaryGetKeysAndValues(CFDictionaryRef theDict, const void **keys, const void **values)
+{
+    const struct CFDictionary *dict = DictionaryReadBegin(theDict);
+    struct DictionaryIterator it;
+    const void *key, *value;
+    CFIndex j = 0;
+    for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &key, &value); ++j)
+    {
+        if(keys)
+            keys[j] = key;
+        if(values)
+            values[j] = value;
+    }
+    DictionaryReadEnd(theDict);
+}
+
+void CFDictionaryApplyFunction(CFDictionaryRef theDict, CFDictionaryApplierFunction applier, void *context)
+{
+    const struct CFDictionary *dict = DictionaryReadBegin(theDict);
+    struct DictionaryIterator it;
+    const void *key, *value;
+    for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &key, &value); )
+    {
+        applier(key, value, context);
+    }
+    DictionaryReadEnd(theDict);
+}
+
+// Concurrent dictionaries: readers resolve the current snapshot inside an epoch
+// section and never lock. Writers, serialized by a lock striped by address, copy
+// the snapshot, change the copy and publish it, then retire the old one.
+#define CONCURRENT_LOCKS 64
+
+static _Atomic uint32_t ConcurrentLocks[CONCURRENT_LOCKS];
+
+static void DictionaryPublish(struct CFDictionary *dict, struct CFDictionary *snapshot)
+{
+    snapshot->flags &= ~kCFObjectFlagMutable;
+    CFPublish(snapshot);
+    __c11_atomic_store(&dict->snapshot, snapshot, __ATOMIC_RELEASE);
+}
+
+void CFDictionaryMakeConcurrent(CFMutableDictionaryRef theDict)
+{
+    struct CFDictionary *dict = theDict;
+    if(dict->flags & kCFDictionaryFlagPersistent)
+        abort();
+    if(dict->flags & kCFDictionaryFlagConcurrent)
+        return;
+    struct CFDictionary *snapshot = CFObjectCreate(CFGetAllocator(dict), kCFTypeDictionary, sizeof(struct CFDictionary));
+    if(!snapshot)
+        abort();
+    // The current contents become the first snapshot as they are.
+    snapshot->elements = dict->elements;
+    snapshot->length = dict->length;
+    snapshot->capacity = dict->capacity;
+    snapshot->removed = dict->removed;
+    snapshot->keyCallbacks = dict->keyCallbacks;
+    snapshot->valueCallbacks = dict->valueCallbacks;
+    snapshot->fingerprint = 0;
+    snapshot->snapshot = NULL;
+    snapshot->root = NULL;
+    snapshot->index = dict->index;
+    dict->elements = NULL;
+    dict->length = 0;
+    dict->capacity = 0;
+    dict->removed = 0;
+    dict->index.slots = NULL;
+    dict->index.ctrl = NULL;
+    dict->index.buckets = 0;
+    dict->flags |= kCFDictionaryFlagConcurrent;
+    DictionaryPublish(dict, snapshot);
+}
+
+CFDictionaryRef CFDictionaryCopySnapshot(CFDictionaryRef theDict)
+{
+    CFDictionaryRef snapshot = CFRetain(DictionaryReadBegin(theDict));
+    DictionaryReadEnd(theDict);
+    return snapshot;
+}
+
+// Trie nodes outlive any single version, so persistent dictionaries never live in arenas.
+static struct CFDictionary* PersistentCreate(CFAllocatorRef allocator, const struct CFDictionary *src)
+{
+    if(AllocatorIsArena(allocator))
+        allocator = kCFAllocatorDefault;
+    struct CFDictionary *dict = CFObjectCreate(allocator, kCFTypeDictionary, sizeof(struct CFDictionary));
+    if(dict)
+    {
+        dict->flags |= kCFDictionaryFlagPersistent;
+        dict->elements = NULL;
+        dict->length = 0;
+        dict->capacity = 0;
+        dict->removed = 0;
+        dict->keyCallbacks = src->keyCallbacks;
+        dict->valueCallbacks = src->valueCallbacks;
+        dict->fingerprint = 0;
+        dict->snapshot = NULL;
+        dict->index.slots = NULL;
+        dict->index.ctrl = NULL;
+        dict->index.buckets = 0;
+        dict->root = NULL;
+    }
+    return dict;
+}
+
+CFDictionaryRef CFDictionaryCreatePersistentCopy(CFAllocatorRef allocator, CFDictionaryRef theDict)
+{
+    const struct CFDictionary *src = DictionaryReadBegin(theDict);
+    struct CFDictionary *dict = PersistentCreate(allocator, src);
+    if(dict)
+    {
+        struct DictionaryIterator it;
+        const void *key, *value;
+        for(DictionaryIteratorInit(&it, src); DictionaryNext(&it, &key, &value); )
+        {
+            Boolean added;
+            struct CFHamtNode *root = HamtSet(dict, dict->root, 0, HashKey(dict->keyCallbacks, key), key, value, &added);
+            if(dict->root)
+                HamtNodeRelease(dict, dict->root, NULL);
+            dict->root = root;
+            dict->length += added;
+        }
+    }
+    DictionaryReadEnd(theDict);
+    return dict;
+}
+
+CFDictionaryRef CFDictionaryCreateCopySettingValue(CFDictionaryRef theDict, const void *key, const void *value)
+{
+    const struct CFDictionary *src = theDict;
+    if(!(src->flags & kCFDictionaryFlagPersistent))
+    {
+        CFDictionaryRef persistent = CFDictionaryCreatePersistentCopy(CFGetAllocator(theDict), theDict);
+        if(!persistent)
+            return NULL;
+        CFDictionaryRef result = CFDictionaryCreateCopySettingValue(persistent, key, value);
+        CFRelease(persistent);
+        return result;
+    }
+    struct CFDictionary *dict = PersistentCreate(CFGetAllocator(src), src);
+    if(dict)
+    {
+        Boolean added;
+        dict->root = HamtSet(dict, src->root, 0, HashKey(dict->keyCallbacks, key), key, value, &added);
+        dict->length = src->length + added;
+    }
+    return dict;
+}
+
+CFDictionaryRef CFDictionaryCreateCopyRemovingValue(CFDictionaryRef theDict, const void *key)
+{
+    const struct CFDictionary *src = theDict;
+    if(!(src->flags & kCFDictionaryFlagPersistent))
+    {
+        CFDictionaryRef persistent = CFDictionaryCreatePersistentCopy(CFGetAllocator(theDict), theDict);
+        if(!persistent)
+            return NULL;
+        CFDictionaryRef result = CFDictionaryCreateCopyRemovingValue(persistent, key);
+        CFRelease(persistent);
+        return result;
+    }
+    if(!HamtFind(src, key))
+        return CFRetain(theDict);
+    struct CFDictionary *dict = PersistentCreate(CFGetAllocator(src), src);
+    if(dict)
+    {
+        dict->root = HamtRemove(dict, src->root, 0, HashKey(dict->keyCallbacks, key), key);
+        dict->length = src->length - 1;
+    }
+    return dict;
+}
+
+static struct CFDictionary* DictionarySnapshotCopy(CFAllocatorRef allocator, const struct CFDictionary *src)
+{
+    struct CFDictionary *copy = CFDictionaryCreateMutable(allocator, src->length - src->removed + 1, src->keyCallbacks, src->valueCallbacks);
+    if(!copy)
+        abort();
+    for(CFIndex i = 0; i < src->length; ++i)
+    {
+        if(src->elements[i].key == kRemovedKey)
+            continue;
+        copy->elements[copy->length] = src->elements[i];
+        CallbacksRetainValues(copy->keyCallbacks, &copy->elements[copy->length].key, 1);
+        CallbacksRetainValues(copy->valueCallbacks, &copy->elements[copy->length].value, 1);
+        copy->length++;
+    }
+    if(copy->length > HASH_INDEX_MIN_LENGTH)
+    {
+        CFDictionaryReindex(copy);
+    }
+    return copy;
+}
+
+static void DictionaryUpdateConcurrent(struct CFDictionary *dict, const void *key, const void *value, Boolean addOnly, Boolean remove)
+{
+    _Atomic uint32_t *lock = &ConcurrentLocks[HashPointer(dict) % CONCURRENT_LOCKS];
+    SpinLock(lock);
+    struct CFDictionary *current = __c11_atomic_load(&dict->snapshot, __ATOMIC_RELAXED);
+    uint64_t hash = 0;
+    CFIndex slot = kNotFound;
+    Boolean present = CFDictionaryFind(current, key, &hash, &slot) != kNotFound;
+    if(remove ? !present : addOnly && present)
+    {
+        SpinUnlock(lock);
+        return;
+    }
+    struct CFDictionary *next = DictionarySnapshotCopy(CFGetAllocator(dict), current);
+    if(remove)
+        CFDictionaryRemoveValue(next, key);
+    else
+        CFDictionaryEnterValue(next, key, value, addOnly);
+    DictionaryPublish(dict, next);
+    SpinUnlock(lock);
+    EpochRetire(current);
+}
+
+// Size of an allocation of `size` bytes from an arena, including alignment.
+static inline CFIndex ArenaSize(CFIndex size)
+{
+    return size ? (size + ARENA_ALIGNMENT - 1) & ~(CFIndex)(ARENA_ALIGNMENT - 1) : ARENA_ALIGNMENT;
+}
+
+static inline CFIndex ArenaObjectSize(CFIndex size)
+{
+    return ArenaSize(ALLOCATOR_PREFIX_SIZE + size);
+}
+
+static CFIndex ArenaContainerSize(CFIndex header, CFIndex elementSize, CFIndex count, Boolean indexed)
+{
+    CFIndex size = ArenaObjectSize(header) + ArenaSize(count * elementSize);
+    if(indexed && count > HASH_INDEX_MIN_LENGTH)
+    {
+        size += ArenaSize(HashIndexSize(HashIndexBuckets(count)));
+    }
+    return size;
+}
+
+// Only values managed with CFRetain are known to be CF objects worth copying.
+static inline Boolean FreezeChildren(const struct CFCallbacks *callbacks)
+{
+    return callbacks && callbacks->retain == CFRetain;
+}
+
+// Upper bound of the arena space needed to copy the tree, counting shared objects once.
+static CFIndex FreezeMeasure(CFTypeRef cf, CFMutableSetRef seen)
+{
+    if(CF_IS_TAGGED_OBJ(cf) || CFSetContainsValue(seen, cf))
+        return 0;
+    CFSetAddValue(seen, cf);
+    CFIndex size = 0;
+    switch(CFGetTypeID(cf))
+    {
+        case kCFTypeString:
+        {
+            CFIndex length = CFStringGetLength(cf);
+            size = ArenaObjectSize(sizeof(struct CFString) + (length < sizeof(((struct CFString*)NULL)->inlineBytes) ? 0 : length + 1));
+            break;
+        }
+        case kCFTypeData:
+            size = ArenaObjectSize(sizeof(struct CFData)) + ArenaSize(CFDataGetLength(cf));
+            break;
+        case kCFTypeNumber:
+            size = ArenaObjectSize(sizeof(struct CFNumber));
+            break;
+        case kCFTypeDate:
+            size = ArenaObjectSize(sizeof(struct CFDate));
+            break;
+        case kCFTypeArray:
+        case kCFTypeSet:
+        {
+            const struct CFArray *arr = cf;
+            Boolean isSet = arr->type == kCFTypeSet;
+            size = ArenaContainerSize(isSet ? sizeof(struct CFSet) : sizeof(struct CFArray), sizeof(*arr->elements), arr->length, isSet);
+            if(FreezeChildren(arr->callbacks))
+            {
+                for(CFIndex i = 0; i < arr->length; ++i)
+                {
+                    size += FreezeMeasure(arr->elements[i], seen);
+                }
+            }
+            break;
+        }
+        case kCFTypeDictionary:
+        {
+            const struct CFDictionary *dict = DictionaryResolve(cf);
+            Boolean keys = FreezeChildren(dict->keyCallbacks),
+                    values = FreezeChildren(dict->valueCallbacks);
+            size = ArenaContainerSize(sizeof(struct CFDictionary), sizeof(*dict->elements), dict->length - dict->removed, true);
+            struct DictionaryIterator it;
+            const void *key, *value;
+            for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &key, &value); )
+            {
+                if(keys)
+                    size += FreezeMeasure(key, seen);
+                if(values)
+                    size += FreezeMeasure(value, seen);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return size;
+}
+
+static CFTypeRef FreezeCopy(CFTypeRef cf, CFAllocatorRef arena, CFMutableDictionaryRef copies)
+{
+    if(CF_IS_TAGGED_OBJ(cf))
+        return cf;
+    CFTypeRef copy = CFDictionaryGetValue(copies, cf);
+    if(copy)
+        return copy;
+    switch(CFGetTypeID(cf))
+    {
+        case kCFTypeString:
+            copy = CFStringCreateWithBytes(arena, (const UInt8*)StringBytes(cf), CFStringGetLength(cf), kCFStringEncodingUTF8, false);
+            break;
+        case kCFTypeData:
+            copy = CFDataCreate(arena, CFDataGetBytePtr(cf), CFDataGetLength(cf));
+            break;
+        case kCFTypeNumber:
+        {
+            const struct CFNumber *num = cf;
+            copy = CFNumberCreate(arena, num->numType, &num->value);
+            break;
+        }
+        case kCFTypeDate:
+            copy = CFDateCreate(arena, CFDateGetAbsoluteTime(cf));
+            break;
+        case kCFTypeArray:
+        {
+            const struct CFArray *arr = cf;
+            Boolean children = FreezeChildren(arr->callbacks);
+            CFMutableArrayRef newArr = CFArrayCreateMutable(arena, arr->length, arr->callbacks);
+            if(!newArr)
+                return NULL;
+            for(CFIndex i = 0; i < arr->length; ++i)
+            {
+                const void *value = children ? FreezeCopy(arr->elements[i], arena, copies) : arr->elements[i];
+                if(!value)
+                    return NULL;
+                CFArrayAppendValue(newArr, value);
+            }
+            copy = newArr;
+            break;
+        }
+        case kCFTypeSet:
+        {
+            const struct CFSet *set = cf;
+            Boolean children = FreezeChildren(set->callbacks);
+            CFMutableSetRef newSet = CFSetCreateMutable(arena, set->length, set->callbacks);
+            if(!newSet)
+                return NULL;
+            for(CFIndex i = 0; i < set->length; ++i)
+            {
+                const void *value = children ? FreezeCopy(set->elements[i], arena, copies) : set->elements[i];
+                if(!value)
+                    return NULL;
+                CFSetAddValue(newSet, value);
+            }
+            copy = newSet;
+            break;
+        }
+        case kCFTypeDictionary:
+        {
+            const struct CFDictionary *dict = DictionaryResolve(cf);
+            Boolean keys = FreezeChildren(dict->keyCallbacks),
+                    values = FreezeChildren(dict->valueCallbacks);
+            CFMutableDictionaryRef newDict = CFDictionaryCreateMutable(arena, dict->length - dict->removed, dict->keyCallbacks, dict->valueCallbacks);
+            if(!newDict)
+                return NULL;
+            struct DictionaryIterator it;
+            const void *key, *value;
+            for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &key, &value); )
+            {
+                if(keys && !(key = FreezeCopy(key, arena, copies)))
+                    return NULL;
+                if(values && !(value = FreezeCopy(value, arena, copies)))
+                    return NULL;
+                CFDictionaryAddValue(newDict, key, value);
+            }
+            copy = newDict;
+            break;
+        }
+        default:
+            // Nothing else can live in an arena, so the tree points at the original;
+            // the containers that hold it take their own reference.
+            CFDictionaryAddValue(copies, cf, cf);
+            return cf;
+    }
+    if(copy)
+    {
+        ((struct CFBase*)copy)->flags |= kCFObjectFlagFrozen;
+        CFDictionaryAddValue(copies, cf, copy);
+    }
+    return copy;
+}
+
+// Copies the tree into a single arena chunk, sized up front.
+// Objects referenced more than once in the tree are copied once.
+CFTypeRef CFFreeze(CFTypeRef cf)
+{
+    if(CF_IS_TAGGED_OBJ(cf))
+        return cf;
+
+    // Keeps the snapshots of concurrent dictionaries alive until they are copied.
+    CFEpochEnter();
+    CFMutableSetRef seen = CFSetCreateMutable(NULL, 0, NULL);
+    CFIndex size = FreezeMeasure(cf, seen);
+    CFRelease(seen);
+
+    struct CFAllocator *arena = (struct CFAllocator*)CFAllocatorCreateArena(NULL, NULL, 0);
+    if(!arena)
+    {
+        CFEpochExit();
+        return NULL;
+    }
+    arena->chunkSize = sizeof(struct CFArenaChunk) + size;
+
+    CFMutableDictionaryRef copies = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+    CFTypeRef frozen = FreezeCopy(cf, arena, copies);
+    CFRelease(copies);
+    CFEpochExit();
+    // Also covers failures, and roots that couldn't be copied into the arena.
+    if(!frozen || CFGetAllocator(frozen) != arena)
+    {
+        CFRelease(arena);
+        // Such a root is the original, and CFFrozenRelease will release it.
+        if(frozen)
+            CFRetain(frozen);
+    }
+    return frozen;
+}
+
+// Trie nodes count towards the payload of dictionaries, once however many versions share them.
+static void MemoryMeasureNodes(const struct CFHamtNode *node, CFMutableSetRef seen, CFMemoryStatistics *stats)
+{
+    if(CFSetContainsValue(seen, node))
+        return;
+    CFSetAddValue(seen, node);
+    stats->payloadBytes += HamtNodeSize(node->entries, node->children);
+    for(CFIndex i = 0; i < node->children; ++i)
+    {
+        MemoryMeasureNodes(HamtChild(node, i), seen, stats);
+    }
+}
+
+static void MemoryMeasure(CFTypeRef cf, CFMutableSetRef seen, CFMemoryStatistics *stats, CFIndex count)
+{
+    if(CF_IS_TAGGED_OBJ(cf) || CFSetContainsValue(seen, cf))
+        return;
+    CFSetAddValue(seen, cf);
+    const struct CFBase *base = cf;
+    if(base->type < count)
+    {
+        stats[base->type].objects++;
+        stats[base->type].headerBytes += ObjectHeaderSize(base->type);
+        stats[base->type].payloadBytes += ObjectInlineSize(base) + ObjectBufferSize(base);
+    }
+    switch(base->type)
+    {
+        case kCFTypeString:
+        case kCFTypeData:
+        {
+            // Objects that own borrowed bytes are kept alive by the tree too.
+            if(base->flags & kCFObjectFlagBorrowed)
+            {
+                CFTypeRef owner = *(const CFTypeRef*)((uintptr_t)base + ObjectHeaderSize(base->type));
+                if(owner && CFGetTypeID(owner) != kCFTypeAllocator)
+                    MemoryMeasure(owner, seen, stats, count);
+            }
+            break;
+        }
+        case kCFTypeArray:
+        case kCFTypeSet:
+        {
+            const struct CFArray *arr = cf;
+            if(FreezeChildren(arr->callbacks))
+            {
+                for(CFIndex i = 0; i < arr->length; ++i)
+                {
+                    MemoryMeasure(arr->elements[i], seen, stats, count);
+                }
+            }
+            break;
+        }
+        case kCFTypeDictionary:
+        {
+            const struct CFDictionary *dict = cf;
+            if(dict->flags & kCFDictionaryFlagConcurrent)
+            {
+                MemoryMeasure(DictionaryResolve(dict), seen, stats, count);
+                break;
+            }
+            if((dict->flags & kCFDictionaryFlagPersistent) && dict->root && kCFTypeDictionary < count)
+                MemoryMeasureNodes(dict->root, seen, &stats[kCFTypeDictionary]);
+            Boolean keys = FreezeChildren(dict->keyCallbacks),
+                    values = FreezeChildren(dict->valueCallbacks);
+            struct DictionaryIterator it;
+            const void *key, *value;
+            for(DictionaryIteratorInit(&it, dict); DictionaryNext(&it, &key, &value); )
+            {
+                if(keys)
+                    MemoryMeasure(key, seen, stats, count);
+                if(values)
+                    MemoryMeasure(value, seen, stats, count);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Counts every object reachable from `cf` once, whatever CF_MEMORY_ACCOUNTING is set to.
+CFIndex CFMemoryMeasure(CFTypeRef cf, CFMemoryStatistics *stats, CFIndex count)
+{
+    memset(stats, 0, (count < CF_TYPE_COUNT ? count : CF_TYPE_COUNT) * sizeof(*stats));
+    CFEpochEnter();
+    CFMutableSetRef seen = CFSetCreateMutable(NULL, 0, NULL);
+    MemoryMeasure(cf, seen, stats, count);
+    CFRelease(seen);
+    CFEpochExit();
+    return CF_TYPE_COUNT;
+}
+
+// Frees everything CFFreeze allocated for `frozen` at once.
+void CFFrozenRelease(CFTypeRef frozen)
+{
+    if(CF_IS_TAGGED_OBJ(frozen))
+        return;
+    if(((const struct CFBase*)frozen)->flags & kCFObjectFlagFrozen)
+        CFRelease(CFGetAllocator(frozen));
+    else
+        CFRelease(frozen);
 }
@@ -34,24 +34,44 @@
 #include <assert.h>
 #include <syslog.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 typedef struct {
-    CFMutableDataRef   data;
+    CFTypeRef          object;
+    int                id;
+} IOCFSerializeIDRef;
+
+#define kIDRefSeenOnce		(-2)
+#define kIDRefShared		(-1)
+#define kIDRefMinShift		56	/* 256 entries */
+
+typedef struct {
+/* The XML is written straight into one growing buffer, which becomes
+ * the bytes of the returned CFData without another copy.
+ */
+    UInt8            * buffer;
+    UInt8            * cursor;
+    UInt8            * limit;
 
     int                idrefNumRefs;
 
-/* For each CFType, we track whether a given plist value hasRefs,
- * and what the ids used for those refs are. 'hasRefs' is set to
- * kCFBooleanFalse the first time we see a given value, so we know
- * we saw it, and then kCFBooleanTrue if we see it again, so we know
- * we need an id for it. On writing out the XML, we generate ids as
- * we encounter the need.
+/* We track whether a given plist value hasRefs, and what the id used
+ * for those refs is, in one open-addressing table keyed by pointer.
+ * An entry is kIDRefSeenOnce the first time we see a given value, so
+ * we know we saw it, and then kIDRefShared if we see it again, so we
+ * know we need an id for it. On writing out the XML, we generate ids
+ * as we encounter the need and store them in the entry itself.
  */
-    CFMutableDictionaryRef stringIDRefDictionary;
-    CFMutableDictionaryRef numberIDRefDictionary;
-    CFMutableDictionaryRef dataIDRefDictionary;
-    CFMutableDictionaryRef dictionaryIDRefDictionary;
-    CFMutableDictionaryRef arrayIDRefDictionary;
-    CFMutableDictionaryRef setIDRefDictionary;
+    IOCFSerializeIDRef * idrefs;
+    IOCFSerializeIDRef * idrefLast;  // the last one previouslySerialized found, for addStartTag
+    uint32_t           idrefCount;
+    uint32_t           idrefShift;
 
 } IOCFSerializeState;
 
@@ -62,167 +82,367 @@ DoCFSerialize(CFTypeRef object, IOCFSerializeState * state);
 static CFDataRef
 IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options);
 
+#define kIOCFSerializeChunkSize	(64 * 1024)
+
+/* Makes room for at least 'size' more bytes at the cursor. The buffer
+ * doubles in size, so the slow path is taken O(log n) times overall.
+ */
 static Boolean
+reserveSpace(CFIndex size, IOCFSerializeState * state)
+{
+	CFIndex	used     = state->cursor - state->buffer;
+	CFIndex	capacity = state->limit - state->buffer;
+	UInt8 *	buffer;
+
+	if (size <= (CFIndex)(state->limit - state->cursor)) return true;
+
+	if (!capacity) capacity = kIOCFSerializeChunkSize;
+	while (capacity - used < size) capacity *= 2;
+
+	buffer = CFAllocatorReallocate(kCFAllocatorDefault, state->buffer, capacity, 0);
+	if (!buffer) return false;
+
+	state->buffer = buffer;
+	state->cursor = buffer + used;
+	state->limit  = buffer + capacity;
+
+	return true;
+}
+
+static inline Boolean
+addBytes(const char * bytes, CFIndex len, IOCFSerializeState * state)
+{
+	if (!reserveSpace(len, state)) return false;
+	memcpy(state->cursor, bytes, len);
+	state->cursor += len;
+
+	return true;
+}
+
+static inline Boolean
 addChar(char chr, IOCFSerializeState * state)
 {
-	CFDataAppendBytes(state->data, (UInt8 *) &chr, 1);
+	if ((state->cursor == state->limit) && !reserveSpace(1, state)) return false;
+	*state->cursor++ = chr;
 
 	return true;
 }
 
-static Boolean
+static inline Boolean
 addString(const char * str, IOCFSerializeState * state)
 {
-	CFIndex	len = strlen(str);
-	CFDataAppendBytes(state->data, (UInt8 *) str, len);
+	return addBytes(str, strlen(str), state);
+}
 
-	return true;
+#define SWAR_ONES		0x0101010101010101ULL
+#define SWAR_HIGHS		0x8080808080808080ULL
+#define SWAR_MATCH(w, c)	((((w) ^ (SWAR_ONES * (c))) - SWAR_ONES) & ~((w) ^ (SWAR_ONES * (c))) & SWAR_HIGHS)
+
+/* Returns the first of '<', '>' or '&' in [p, end), or end if there is none.
+ * Almost nothing needs escaping, so this scans a vector (or a word) at a time.
+ */
+static inline const char *
+findEscape(const char * p, const char * end)
+{
+#if defined(__AVX2__)
+	const __m256i lt  = _mm256_set1_epi8('<');
+	const __m256i gt  = _mm256_set1_epi8('>');
+	const __m256i amp = _mm256_set1_epi8('&');
+
+	for (; end - p >= 32; p += 32) {
+		__m256i  v    = _mm256_loadu_si256((const __m256i *) p);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(
+					_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+					_mm256_cmpeq_epi8(v, amp)));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i lt  = _mm_set1_epi8('<');
+	const __m128i gt  = _mm_set1_epi8('>');
+	const __m128i amp = _mm_set1_epi8('&');
+
+	for (; end - p >= 16; p += 16) {
+		__m128i  v    = _mm_loadu_si128((const __m128i *) p);
+		uint32_t mask = _mm_movemask_epi8(_mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+					_mm_cmpeq_epi8(v, amp)));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#else
+	/* The lowest flagged byte is always a real match, so on little endian
+	 * it can be taken straight from the mask; otherwise the tail loop finds it.
+	 */
+	for (; end - p >= 8; p += 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		uint64_t mask = SWAR_MATCH(w, '<') | SWAR_MATCH(w, '>') | SWAR_MATCH(w, '&');
+		if (mask) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return p + (__builtin_ctzll(mask) >> 3);
+#else
+			break;
+#endif
+		}
+	}
+#endif
+	for (; p < end; p++) {
+		if ((*p == '<') || (*p == '>') || (*p == '&')) break;
+	}
+	return p;
 }
 
-static const char *
-getTagString(CFTypeRef object)
+/* Copies the clean runs in bulk and escapes the bytes in between.
+ * This works because all bytes in a multi-byte utf-8 character have the high order bit set.
+ */
+static Boolean
+addEscaped(const char * buffer, CFIndex length, IOCFSerializeState * state)
+{
+	const char * end = buffer + length;
+	const char * p;
+
+	for (;;) {
+		p = findEscape(buffer, end);
+		if (!addBytes(buffer, p - buffer, state)) return false;
+		if (p == end) return true;
+
+		switch (*p) {
+			case '<':
+				if (!addBytes("&lt;", 4, state)) return false;
+				break;
+			case '>':
+				if (!addBytes("&gt;", 4, state)) return false;
+				break;
+			default:
+				if (!addBytes("&amp;", 5, state)) return false;
+				break;
+		}
+		buffer = p + 1;
+	}
+}
+
+/* The opening tag leaves off its '>', so that attributes can follow it.
+ */
+typedef struct {
+	const char * open;
+	const char * close;
+	CFIndex      openLength;
+	CFIndex      closeLength;
+} IOCFSerializeTag;
+
+#define TAG(name)	{ "<" name, "</" name ">", sizeof(name), sizeof(name) + 2 }
+
+static const IOCFSerializeTag tags[] = {
+	[kCFTypeString]     = TAG("string"),
+	[kCFTypeNumber]     = TAG("integer"),
+	[kCFTypeData]       = TAG("data"),
+	[kCFTypeDictionary] = TAG("dict"),
+	[kCFTypeArray]      = TAG("array"),
+	[kCFTypeSet]        = TAG("set"),
+};
+static const IOCFSerializeTag internalErrorTag = TAG("internal error");
+
+static inline const IOCFSerializeTag *
+getTag(CFTypeRef object)
 {
 	CFTypeID type;
 
 	assert(object);
 
 	type = CFGetTypeID(object);
+	if ((type < sizeof(tags) / sizeof(tags[0])) && tags[type].open) return &tags[type];
+
+	return &internalErrorTag;
+}
 
-	if (type == CFStringGetTypeID()) return "string";
-	if (type == CFNumberGetTypeID()) return "integer";
-	if (type == CFDataGetTypeID()) return "data";
-	if (type == CFDictionaryGetTypeID()) return "dict";
-	if (type == CFArrayGetTypeID()) return "array";
-	if (type == CFSetGetTypeID()) return "set";
+static const char digitPairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
 
-	return "internal error";
+/* Same output as "%d", two digits at a time from the back.
+ */
+static Boolean
+addDecimal(int value, IOCFSerializeState * state)
+{
+	char         temp[12];
+	char       * p = temp + sizeof(temp);
+	unsigned int v = (value < 0) ? 0U - (unsigned int) value : (unsigned int) value;
+
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, &digitPairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &digitPairs[v * 2], 2);
+	} else {
+		*--p = '0' + v;
+	}
+	if (value < 0) *--p = '-';
+
+	return addBytes(p, temp + sizeof(temp) - p, state);
 }
 
-static CFMutableDictionaryRef
-idRefDictionaryForObject(
-    CFTypeRef              object,
-    IOCFSerializeState   * state)
+/* Same output as "0x%qx", written straight into the output buffer.
+ */
+static Boolean
+addHex(unsigned long long value, IOCFSerializeState * state)
 {
-    CFMutableDictionaryRef result     = NULL;
-    CFTypeID               objectType = CFNullGetTypeID();  // do not release
+	CFIndex	digits = (64 - __builtin_clzll(value | 1) + 3) / 4;
+	UInt8 *	p;
 
-    objectType = CFGetTypeID(object);
+	if (!reserveSpace(2 + digits, state)) return false;
 
-   /* Sorted by rough order of % occurence in big plists.
-    */
-	if (objectType == CFDictionaryGetTypeID()) {
-        result = state->dictionaryIDRefDictionary;
-    } else if (objectType == CFStringGetTypeID()) {
-        result = state->stringIDRefDictionary;
-    } else if (objectType == CFArrayGetTypeID()) {
-        result = state->arrayIDRefDictionary;
-    } else if (objectType == CFNumberGetTypeID()) {
-        result = state->numberIDRefDictionary;
-    } else if (objectType == CFDataGetTypeID()) {
-        result = state->dataIDRefDictionary;
-    } else if (objectType == CFSetGetTypeID()) {
-        result = state->setIDRefDictionary;
-    }
+	state->cursor[0] = '0';
+	state->cursor[1] = 'x';
+	state->cursor += 2 + digits;
+	for (p = state->cursor; digits--; value >>= 4) {
+		*--p = "0123456789abcdef"[value & 0xf];
+	}
 
-	return result;
+	return true;
 }
 
-void
-recordObjectInIDRefDictionary(
-    CFTypeRef              object,
-    IOCFSerializeState   * state)
+/* Tagged numbers have no identity of their own, equal values
+ * share a pointer, so they never get an ID. Neither do the types
+ * without a tag, like booleans.
+ */
+static inline Boolean
+canHaveIDRef(CFTypeRef object)
 {
-    CFTypeRef              refEntry        = NULL;  // do not release
-    CFMutableDictionaryRef idRefDictionary = NULL;  // do not release
+    CFTypeID type;
 
-    if (!object || !state) {
-        goto finish;
+    if (CF_IS_TAGGED_OBJ(object)) {
+        return false;
     }
+    type = CFGetTypeID(object);
+    return (type < sizeof(tags) / sizeof(tags[0])) && tags[type].open;
+}
 
-    idRefDictionary = idRefDictionaryForObject(object, state);
-    if (!idRefDictionary) {
-        goto finish;
+/* Pages are scattered across the table, but objects on the same page
+ * land near each other, so walking a tree mostly stays in cache.
+ */
+static inline IOCFSerializeIDRef *
+idRefSlot(IOCFSerializeIDRef * table, uint32_t shift, CFTypeRef object)
+{
+    uint64_t mask = ((uint64_t)1 << (64 - shift)) - 1;
+    uint64_t p    = (uint64_t)(uintptr_t)object;
+    uint64_t i    = (((p >> 12) * 0x9e3779b97f4a7c15ULL) >> shift ^ (p >> 4)) & mask;
+
+    while (table[i].object && (table[i].object != object)) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+/* Returns the entry for the object, or NULL if it has none. With 'insert',
+ * a missing entry is added as kIDRefSeenOnce instead, and NULL means we
+ * ran out of memory.
+ */
+static IOCFSerializeIDRef *
+findIDRef(CFTypeRef object, Boolean insert, IOCFSerializeState * state)
+{
+    IOCFSerializeIDRef * table = state->idrefs;
+    IOCFSerializeIDRef * entry;
+    uint32_t             shift = state->idrefShift;
+    uint32_t             i;
+
+    if (!table) {
+        return NULL;
     }
 
-	refEntry = CFDictionaryGetValue(idRefDictionary, object);
+    entry = idRefSlot(table, shift, object);
+    if (entry->object || !insert) {
+        return entry->object ? entry : NULL;
+    }
 
-   /* If we have never seen this object value, then add an entry
-    * in the dictionary with value false, indicating we have seen
-    * it once.
-    *
-    * If we have seen this object value, then set its entry to true
-    * to indicate that we have now seen a second occurrence
-    * of the object value, which means we will generate an ID and IDREFs
-    * in the XML.
+   /* Keep the table at most half full, so probe runs stay short.
     */
-    if (!refEntry) {
-       /* Use AddValue here so as not to overwrite.
-        */
-        CFDictionaryAddValue(idRefDictionary, object, kCFBooleanFalse);
-    } else {
-        CFDictionarySetValue(idRefDictionary, object, kCFBooleanTrue);
+    if ((uint64_t)(state->idrefCount + 1) * 2 > ((uint64_t)1 << (64 - shift))) {
+        shift--;
+        table = calloc((size_t)1 << (64 - shift), sizeof(*table));
+        if (!table) {
+            return NULL;
+        }
+        for (i = 0; i < ((uint32_t)1 << (64 - state->idrefShift)); i++) {
+            if (state->idrefs[i].object) {
+                *idRefSlot(table, shift, state->idrefs[i].object) = state->idrefs[i];
+            }
+        }
+        free(state->idrefs);
+        state->idrefs     = table;
+        state->idrefShift = shift;
+        entry = idRefSlot(table, shift, object);
     }
 
-finish:
-    return;
+   /* The table keeps what it points at alive: a child reached through a
+    * concurrent dictionary's snapshot could otherwise be freed once the
+    * snapshot goes, and its address handed out again to another object.
+    */
+    entry->object = CFRetain(object);
+    entry->id     = kIDRefSeenOnce;
+    state->idrefCount++;
+
+    return entry;
 }
 
-Boolean
-previouslySerialized(
+static Boolean
+recordObjectInIDRefTable(
     CFTypeRef            object,
     IOCFSerializeState * state)
 {
-    Boolean                result     = FALSE;
-    CFMutableDictionaryRef idRefDict  = NULL;  // do not release
-    CFTypeRef              idRefEntry = NULL;  // do not release
-    CFTypeID               idRefType  = CFNullGetTypeID();  // do not release
-    char                   temp[64];
-    int                    idInt      = -1;
-
-    if (!object || !state) {
-        goto finish;
+    IOCFSerializeIDRef * entry;
+    uint32_t             count = state->idrefCount;
+
+    if (!canHaveIDRef(object)) {
+        return true;
     }
 
-   /* If we don't get a lookup dict or an entry for the object,
-    * then no ID or IDREF will be involved,
-    * so treat is if never before serialized.
+   /* If we have never seen this object value, then the entry is added
+    * with kIDRefSeenOnce, indicating we have seen it once.
+    *
+    * If we have seen this object value, then set its entry to
+    * kIDRefShared to indicate that we have now seen a second occurrence
+    * of the object value, which means we will generate an ID and IDREFs
+    * in the XML.
     */
-    idRefDict = idRefDictionaryForObject(object, state);
-    if (!idRefDict) {
-        goto finish;
+    entry = findIDRef(object, true, state);
+    if (!entry) {
+        return false;
     }
-
-    idRefEntry = (CFTypeRef)CFDictionaryGetValue(idRefDict, object);
-    if (!idRefEntry) {
-        goto finish;
+    if (state->idrefCount == count) {
+        entry->id = kIDRefShared;
     }
 
-    idRefType = CFGetTypeID(idRefEntry);
+    return true;
+}
 
-   /* If the entry is of Boolean type, then an ID/IDREF may be involved,
-    * but we haven't created one yet, so not yet serialized.
-    */
-    if (idRefType == CFBooleanGetTypeID()) {
-        goto finish;
-    }
+Boolean
+previouslySerialized(
+    CFTypeRef            object,
+    IOCFSerializeState * state)
+{
+    IOCFSerializeIDRef     * entry;
+    const IOCFSerializeTag * tag;
 
-   /* At this point the entry should be a CFNumber.
+   /* If we don't get an entry for the object, or it has no ID yet,
+    * then no IDREF will be involved, so treat is if never before serialized.
     */
-    if (idRefType != CFNumberGetTypeID()) {
-        goto finish;
+    if (!object || !state || !state->idrefs || !canHaveIDRef(object)) {
+        return false;
     }
 
-   /* Finally, get the IDREF value out of the idRef entry and write the
-    * XML for it. Bail on extraction error.
-    */
-    if (!CFNumberGetValue((CFNumberRef)idRefEntry, kCFNumberIntType, &idInt)) {
-        goto finish;
+    entry = state->idrefLast = findIDRef(object, false, state);
+    if (!entry || (entry->id < 0)) {
+        return false;
     }
-    snprintf(temp, sizeof(temp), "<%s IDREF=\"%d\"/>", getTagString(object), idInt);
-    result = addString(temp, state);
 
-finish:
-	return result;
+    tag = getTag(object);
+    return addBytes(tag->open, tag->openLength, state) &&
+           addBytes(" IDREF=\"", 8, state) &&
+           addDecimal(entry->id, state) &&
+           addBytes("\"/>", 3, state);
 }
 
 static Boolean
@@ -231,48 +451,32 @@ addStartTag(
     const char         * additionalTags,
     IOCFSerializeState * state)
 {
-    CFMutableDictionaryRef idRefDict  = NULL;  // do not release
-    CFTypeRef              idRefEntry = NULL;  // do not release
-	CFNumberRef            idRef = NULL;  // must release
-	char                   temp[128];
-
-    idRefDict = idRefDictionaryForObject(object, state);
-    if (idRefDict) {
-        idRefEntry = (CFTypeRef)CFDictionaryGetValue(idRefDict, object);
+    IOCFSerializeIDRef     * entry = NULL;
+	const IOCFSerializeTag * tag = getTag(object);
+
+	if (!addBytes(tag->open, tag->openLength, state)) return false;
+
+    if (state->idrefLast && (state->idrefLast->object == object)) {
+        entry = state->idrefLast;
+    } else if (state->idrefs && canHaveIDRef(object)) {
+        entry = findIDRef(object, false, state);
     }
 
-   /* If the IDRef entry is 'true', then we know we have an object value
+   /* If the entry is kIDRefShared, then we know we have an object value
     * with multiple references and need to emit an ID. So we create one
-    * by incrementing the state's counter, making a CFNumber, and *replacing*
-    * the boolean value in the IDRef dictionary with that number.
+    * by incrementing the state's counter and storing it in the entry.
     */
-	if (idRefEntry == kCFBooleanTrue) {
-        int idInt = state->idrefNumRefs++;
-
-        idRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &idInt);
-        assert(idRef);
+	if (entry && (entry->id == kIDRefShared)) {
+        entry->id = state->idrefNumRefs++;
 
-        CFDictionarySetValue(idRefDict, object, idRef);
-        CFRelease(idRef);
+		if (!addBytes(" ID=\"", 5, state) || !addDecimal(entry->id, state) || !addChar('"', state)) return false;
+	}
 
-		if (additionalTags) {
-			snprintf(temp, sizeof(temp) * sizeof(char),
-                        	"<%s ID=\"%d\" %s>", getTagString(object), idInt, additionalTags);
-		} else {
-			snprintf(temp, sizeof(temp) * sizeof(char),
-                        	"<%s ID=\"%d\">", getTagString(object), idInt);
-		}
-	} else {
-		if (additionalTags) {
-			snprintf(temp, sizeof(temp) * sizeof(char),
-                        	"<%s %s>", getTagString(object), additionalTags);
-		} else {
-			snprintf(temp, sizeof(temp) * sizeof(char),
-                        	"<%s>", getTagString(object));
-		}
+	if (additionalTags) {
+		if (!addChar(' ', state) || !addString(additionalTags, state)) return false;
 	}
 
-	return addString(temp, state);
+	return addChar('>', state);
 }
 
 
@@ -280,17 +484,15 @@ static Boolean
 addEndTag(CFTypeRef object,
 	  IOCFSerializeState * state)
 {
-	char temp[128];
+	const IOCFSerializeTag * tag = getTag(object);
 
-	snprintf(temp, sizeof(temp) * sizeof(char), "</%s>", getTagString(object));
-
-	return addString(temp, state);
+	return addBytes(tag->close, tag->closeLength, state);
 }
 
 static Boolean
 DoCFSerializeNumber(CFNumberRef object, IOCFSerializeState * state)
 {
-	char		temp[32];
+	const char *	sizeAttribute;
 	long long	value;
 	int		size;
 
@@ -331,15 +533,19 @@ DoCFSerializeNumber(CFNumberRef object, IOCFSerializeState * state)
 		break;
 	}
 
-	snprintf(temp, sizeof(temp), "size=\"%d\"", size);
-	if (!addStartTag(object, temp, state)) return false;
-
-	if (size <= 32)
-		snprintf(temp, sizeof(temp), "0x%lx", (unsigned long int) value);
-	else
-		snprintf(temp, sizeof(temp), "0x%qx", value);
+	switch (size) {
+	case 8:  sizeAttribute = "size=\"8\"";  break;
+	case 16: sizeAttribute = "size=\"16\""; break;
+	case 32: sizeAttribute = "size=\"32\""; break;
+	default: sizeAttribute = "size=\"64\""; break;
+	}
+	if (!addStartTag(object, sizeAttribute, state)) return false;
 
-	if (!addString(temp, state)) return false;
+	if (size <= 32) {
+		if (!addHex((unsigned long int) value, state)) return false;
+	} else {
+		if (!addHex(value, state)) return false;
+	}
 
 	return addEndTag(object, state);
 }
@@ -356,39 +562,26 @@ DoCFSerializeString(CFStringRef object, IOCFSerializeState * state)
 	CFDataRef   dataBuffer = 0;
 	const char  *buffer = "";
 	CFIndex     length = 0;
-	char        c;
-	int         i;
     Boolean     succeeded = true;
 
 	if (previouslySerialized(object, state)) return true;
 
 	if (!addStartTag(object, 0, state)) return false;
 
-	dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, object, kCFStringEncodingUTF8, '?');
+	// use the string's own bytes when we can, and only copy them out otherwise
+	if ((buffer = CFStringGetCStringPtr(object, kCFStringEncodingUTF8))) {
+		length = CFStringGetLength(object);
+	} else {
+		buffer = "";
+		dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, object, kCFStringEncodingUTF8, '?');
+	}
 
 	if (dataBuffer) {
 		length = CFDataGetLength(dataBuffer);
 		buffer = (char *) CFDataGetBytePtr(dataBuffer);
 	}
 
-	// this works because all bytes in a multi-byte utf-8 character have the high order bit set
-	for (i = 0; (i < length) && succeeded; i++) {
-		c = buffer[i];
-        switch (c) {
-            case '<':
-                succeeded = addString("&lt;", state);
-                break;
-            case '>':
-                succeeded = addString("&gt;", state);
-                break;
-            case '&':
-                succeeded = addString("&amp;", state);
-                break;
-            default:
-                succeeded = addChar(c, state);
-                break;
-        }
-	}
+	succeeded = addEscaped(buffer, length, state);
 
 	if (dataBuffer) CFRelease(dataBuffer);
 
@@ -398,58 +591,67 @@ DoCFSerializeString(CFStringRef object, IOCFSerializeState * state)
         return false;
 }
 
+#define CLASS_NAME(s)	{ s, sizeof(s) - 1 }
+
+static const struct {
+	const char * name;
+	CFIndex      length;
+} classNames[] = {
+	CLASS_NAME("AppleLSIFusionFC"), CLASS_NAME("AppleLSIFusionSAS"), CLASS_NAME("AppleLSIFusionSCSI"),
+	CLASS_NAME("AppleUSBXHCI"), CLASS_NAME("ICH8 ATA/100"), CLASS_NAME("Physical Interconnect Location"),
+	CLASS_NAME("IOPCITunnelCompatible")
+};
+
+/* Same as strncmp(key, name, length) == 0 against any of the names above:
+ * the key is a prefix of a name (the empty key is one of every name), or is
+ * a name followed by a NUL. The first byte rules out nearly every key early.
+ */
+static Boolean
+isClassNameKey(const char * key, CFIndex length)
+{
+	unsigned int i;
+
+	if (!length) return true;
+
+	for (i = 0; i < sizeof(classNames) / sizeof(classNames[0]); i++) {
+		CFIndex n = classNames[i].length;
+
+		if (key[0] != classNames[i].name[0]) continue;
+		if ((length <= n) ? !memcmp(key, classNames[i].name, length)
+				  : (!key[n] && !memcmp(key, classNames[i].name, n))) return true;
+	}
+	return false;
+}
+
 static Boolean
 DoCFSerializeKey(CFStringRef object, IOCFSerializeState * state)
 {
 	CFDataRef   dataBuffer = 0;
 	const char  *buffer = "";
 	CFIndex     length = 0;
-	char        c;
-	int         i;
 	Boolean     succeeded = true;
 
 	const char *getOffMyXMLawn = "<!-- \xf0\x9f\xa4\xa6 -->";
-	const char *classNames[] = { "AppleLSIFusionFC", "AppleLSIFusionSAS", "AppleLSIFusionSCSI",
-				     "AppleUSBXHCI", "ICH8 ATA/100", "Physical Interconnect Location",
-				     "IOPCITunnelCompatible" };
-	int         numClasses   = (sizeof(classNames) / sizeof(classNames[0]));
 	bool        matches      = false;
 
 	if (!addString("<key>", state)) return false;
 
-	dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, object, kCFStringEncodingUTF8, '?');
+	// use the string's own bytes when we can, and only copy them out otherwise
+	if ((buffer = CFStringGetCStringPtr(object, kCFStringEncodingUTF8))) {
+		length = CFStringGetLength(object);
+	} else {
+		buffer = "";
+		dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, object, kCFStringEncodingUTF8, '?');
+	}
 
 	if (dataBuffer) {
 		length = CFDataGetLength(dataBuffer);
 		buffer = (char *) CFDataGetBytePtr(dataBuffer);
 	}
 
-	for (i = 0; i < numClasses; i++) {
-		if (!strncmp(buffer, classNames[i], length)) {
-			matches = true;
-			break;
-		}
-	}
-
-	// this works because all bytes in a multi-byte utf-8 character have the high order bit set
-	for (i = 0; (i < length) && succeeded; i++) {
-		c = buffer[i];
+	matches = isClassNameKey(buffer, length);
 
-		switch (c) {
-			case '<':
-				succeeded = addString("&lt;", state);
-				break;
-			case '>':
-				succeeded = addString("&gt;", state);
-				break;
-			case '&':
-				succeeded = addString("&amp;", state);
-				break;
-			default:
-				succeeded = addChar(c, state);
-			    break;
-		}
-	}
+	succeeded = addEscaped(buffer, length, state);
 
 	if (dataBuffer) CFRelease(dataBuffer);
 
@@ -468,56 +670,83 @@ DoCFSerializeKey(CFStringRef object, IOCFSerializeState * state)
 //this was taken from CFPropertyList.c
 static const char __CFPLDataEncodeTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static Boolean
-DoCFSerializeData(CFDataRef object, IOCFSerializeState * state)
+#if defined(__SSSE3__)
+/* Spreads 12 bytes into 16 six-bit indices and maps them onto the table
+ * above without a lookup: each index range gets its own offset.
+ */
+static inline __m128i
+encodeBase64Block(__m128i in)
 {
-	CFIndex	  length;
-	const UInt8 * bytes;
-        CFIndex i;
-        const unsigned char *p;
-        unsigned char c = 0;
-
-	if (previouslySerialized(object, state)) return true;
+	const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					       '/' - 63, 'A', 0, 0);
+	__m128i indices, t0, t1, result;
+
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	indices = _mm_or_si128(t0, t1);
+
+	result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	result = _mm_or_si128(result, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	return _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, result), indices);
+}
+#endif
 
-	length = CFDataGetLength(object);
-	bytes = CFDataGetBytePtr(object);
+/* Encodes 3 bytes to 4 characters at a time, straight into the output buffer.
+ */
+static Boolean
+addBase64(const UInt8 * bytes, CFIndex length, IOCFSerializeState * state)
+{
+	const UInt8 * end = bytes + length;
+	UInt8 *       out;
+	uint32_t      w;
 
-        if (!addStartTag(object, 0, state)) return false;
+	if (!reserveSpace((length + 2) / 3 * 4, state)) return false;
+	out = state->cursor;
 
-        for (i = 0, p = (unsigned char *)bytes; i < length; i++, p++) {
-		/* 3 bytes are encoded as 4 */
-		switch (i % 3) {
-                case 0:
-			c = __CFPLDataEncodeTable [ ((p[0] >> 2) & 0x3f)];
-			if (!addChar(c, state)) return false;
-			break;
-                case 1:
-			c = __CFPLDataEncodeTable [ ((((p[-1] << 8) | p[0]) >> 4) & 0x3f)];
-			if (!addChar(c, state)) return false;
-			break;
-                case 2:
-			c = __CFPLDataEncodeTable [ ((((p[-1] << 8) | p[0]) >> 6) & 0x3f)];
-			if (!addChar(c, state)) return false;
-			c = __CFPLDataEncodeTable [ (p[0] & 0x3f)];
-			if (!addChar(c, state)) return false;
-			break;
-		}
-        }
-        switch (i % 3) {
-	case 0:
-                break;
+#if defined(__SSSE3__)
+	/* Loads 16 bytes but only encodes 12 of them, so stop while 16 remain. */
+	for (; end - bytes >= 16; bytes += 12, out += 16) {
+		_mm_storeu_si128((__m128i *) out, encodeBase64Block(_mm_loadu_si128((const __m128i *) bytes)));
+	}
+#endif
+	for (; end - bytes >= 3; bytes += 3, out += 4) {
+		w = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+		out[0] = __CFPLDataEncodeTable[w >> 18];
+		out[1] = __CFPLDataEncodeTable[(w >> 12) & 0x3f];
+		out[2] = __CFPLDataEncodeTable[(w >> 6) & 0x3f];
+		out[3] = __CFPLDataEncodeTable[w & 0x3f];
+	}
+	switch (end - bytes) {
 	case 1:
-                c = __CFPLDataEncodeTable [ ((p[-1] << 4) & 0x30)];
-                if (!addChar(c, state)) return false;
-                if (!addChar('=', state)) return false;
-                if (!addChar('=', state)) return false;
-                break;
+		out[0] = __CFPLDataEncodeTable[bytes[0] >> 2];
+		out[1] = __CFPLDataEncodeTable[(bytes[0] << 4) & 0x30];
+		out[2] = '=';
+		out[3] = '=';
+		out += 4;
+		break;
 	case 2:
-                c = __CFPLDataEncodeTable [ ((p[-1] << 2) & 0x3c)];
-                if (!addChar(c, state)) return false;
-                if (!addChar('=', state)) return false;
-                break;
-        }
+		out[0] = __CFPLDataEncodeTable[bytes[0] >> 2];
+		out[1] = __CFPLDataEncodeTable[((bytes[0] << 4) | (bytes[1] >> 4)) & 0x3f];
+		out[2] = __CFPLDataEncodeTable[(bytes[1] << 2) & 0x3c];
+		out[3] = '=';
+		out += 4;
+		break;
+	}
+
+	state->cursor = out;
+	return true;
+}
+
+static Boolean
+DoCFSerializeData(CFDataRef object, IOCFSerializeState * state)
+{
+	if (previouslySerialized(object, state)) return true;
+
+	if (!addStartTag(object, 0, state)) return false;
+
+	if (!addBase64(CFDataGetBytePtr(object), CFDataGetLength(object), state)) return false;
 
 	return addEndTag(object, state);
 }
@@ -582,20 +811,25 @@ DoCFSerializeDictionary(CFDictionaryRef object,
 	CFIndex	  count, i;
 	const void ** values;
 	const void ** keys;
+	CFDictionaryRef	  snapshot;
 	Boolean	  ok = true;
 
 	if (previouslySerialized(object, state)) return true;
 
         if (!addStartTag(object, 0, state)) return false;
 
-	count = CFDictionaryGetCount(object);
+	/* keys and values stay alive, and the count right, while writers race */
+	snapshot = CFDictionaryCopySnapshot(object);
+	count = CFDictionaryGetCount(snapshot);
 
 	if (count) {
 		values = (const void **) malloc(2 * count * sizeof(void *));
-		if (!values)
+		if (!values) {
+			CFRelease(snapshot);
 			return false;
+		}
 		keys = values + count;
-		CFDictionaryGetKeysAndValues(object, keys, values);
+		CFDictionaryGetKeysAndValues(snapshot, keys, values);
 	} else {
 		values = keys = 0;
 	}
@@ -610,6 +844,7 @@ DoCFSerializeDictionary(CFDictionaryRef object,
 
 	if (values)
 		free(values);
+	CFRelease(snapshot);
 
 	return ok && addEndTag(object, state);
 }
@@ -625,17 +860,20 @@ DoIdrefScan(CFTypeRef object, IOCFSerializeState * state)
 
 	assert(object);
 
-	recordObjectInIDRefDictionary(object, state);
+	if (!recordObjectInIDRefTable(object, state)) {
+		return false;
+	}
 
 	type = CFGetTypeID(object);
 
 	if (type == CFDictionaryGetTypeID()) {
-		CFDictionaryRef dict = (CFDictionaryRef)object;
+		CFDictionaryRef dict = CFDictionaryCopySnapshot((CFDictionaryRef)object);
 		count = CFDictionaryGetCount(dict);
 		if (count) {
 			keys = (const void **)malloc(count * sizeof(void *));
 			values = (const void **)malloc(count * sizeof(void *));
 			if (!keys || !values) {
+				CFRelease(dict);
 				return false;
 			}
 			CFDictionaryGetKeysAndValues(dict, keys, values);
@@ -646,9 +884,10 @@ DoIdrefScan(CFTypeRef object, IOCFSerializeState * state)
 
 			free(keys);
 			free(values);
-			if (!ok) {
-				return ok;
-			}
+		}
+		CFRelease(dict);
+		if (!ok) {
+			return ok;
 		}
     } else if (type == CFArrayGetTypeID()) {
 		CFArrayRef array = (CFArrayRef)object;
@@ -731,56 +970,37 @@ IOCFSerialize(CFTypeRef object, CFOptionFlags options)
 {
     IOCFSerializeState       state;
     Boolean			         ok   = FALSE;
-    CFDictionaryKeyCallBacks idrefKeyCallbacks;
+    CFDataRef                result = NULL;
+    CFIndex                  length;
+    uint32_t                 i;
 
     if (!object) return 0;
 #if IOKIT_SERVER_VERSION >= 20140421
     if (kIOCFSerializeToBinary & options) return IOCFSerializeBinary(object, options);
 #endif /* IOKIT_SERVER_VERSION >= 20140421 */
-    if (options) return 0;
+    if (options & ~kIOCFSerializeNoSharedNodes) return 0;
 
-    state.data = CFDataCreateMutable(kCFAllocatorDefault, 0);
-    assert(state.data);
+    state.buffer = state.cursor = state.limit = NULL;
 
     state.idrefNumRefs = 0;
+    state.idrefs       = NULL;
+    state.idrefLast    = NULL;
+    state.idrefCount   = 0;
+    state.idrefShift   = kIDRefMinShift;
 
-    idrefKeyCallbacks = kCFTypeDictionaryKeyCallBacks;
-    // only use pointer equality for these keys
-    idrefKeyCallbacks.equal = NULL;
-
-    state.stringIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.stringIDRefDictionary);
-
-    state.numberIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.numberIDRefDictionary);
-
-    state.dataIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.dataIDRefDictionary);
-
-    state.dictionaryIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.dictionaryIDRefDictionary);
-
-    state.arrayIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.arrayIDRefDictionary);
-
-    state.setIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.setIDRefDictionary);
+   /* Without the census no entry is ever made, so nothing gets an ID
+    * and shared nodes are simply written out in full each time.
+    */
+    if (!(options & kIOCFSerializeNoSharedNodes)) {
+        state.idrefs = calloc((size_t)1 << (64 - kIDRefMinShift), sizeof(*state.idrefs));
+        if (!state.idrefs) {
+            goto finish;
+        }
 
-    ok = DoIdrefScan(object, &state);
-    if (!ok) {
-        goto finish;
+        ok = DoIdrefScan(object, &state);
+        if (!ok) {
+            goto finish;
+        }
     }
 
     ok = DoCFSerialize(object, &state);
@@ -792,20 +1012,26 @@ IOCFSerialize(CFTypeRef object, CFOptionFlags options)
         goto finish;
     }
 
+   /* Trim the slack off the last chunk and hand the buffer over to
+    * the CFData, which frees it with the default allocator.
+    */
+    length = state.cursor - state.buffer;
+    state.buffer = CFAllocatorReallocate(kCFAllocatorDefault, state.buffer, length, 0);
+    assert(state.buffer);
+    result = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, state.buffer, length, kCFAllocatorDefault);
+    state.buffer = NULL;  // it's returned
+
 finish:
-    if (!ok && state.data) {
-        CFRelease(state.data);
-        state.data = NULL;  // it's returned
-    }
+    if (state.buffer) CFAllocatorDeallocate(kCFAllocatorDefault, state.buffer);
 
-    if (state.stringIDRefDictionary)     CFRelease(state.stringIDRefDictionary);
-    if (state.numberIDRefDictionary)     CFRelease(state.numberIDRefDictionary);
-    if (state.dataIDRefDictionary)       CFRelease(state.dataIDRefDictionary);
-    if (state.dictionaryIDRefDictionary) CFRelease(state.dictionaryIDRefDictionary);
-    if (state.arrayIDRefDictionary)      CFRelease(state.arrayIDRefDictionary);
-    if (state.setIDRefDictionary)        CFRelease(state.setIDRefDictionary);
+    if (state.idrefs) {
+        for (i = 0; i < ((uint32_t)1 << (64 - state.idrefShift)); i++) {
+            if (state.idrefs[i].object) CFRelease(state.idrefs[i].object);
+        }
+        free(state.idrefs);
+    }
 
-    return state.data;
+    return result;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -839,13 +1065,20 @@ IOCFSerializeBinaryAdd(IOCFSerializeBinaryState * state, const void * bits, size
 	return true;
 }
 
+static inline Boolean
+IOCFSerializeBinaryIsTaggedNumber(CFTypeRef o)
+{
+	return (CF_IS_TAGGED_OBJ(o) && CF_TAGGED_OBJ_TYPE(o) == CFNumberGetTypeID());
+}
+
 static Boolean
 IOCFSerializeBinaryAddObject(IOCFSerializeBinaryState * state,
 								  CFTypeRef o, uint32_t key,
 								  const void * bits, size_t size, size_t zero)
 {
-    // add to tag dictionary
-	CFDictionarySetValue(state->tags, o, (const void *)state->tag);
+    // add to tag dictionary, tagged numbers are written out every time
+	if (!IOCFSerializeBinaryIsTaggedNumber(o))
+		CFDictionarySetValue(state->tags, o, (const void *)state->tag);
 	state->tag++;
 
     if (state->endCollection)
@@ -907,7 +1140,7 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
     uintptr_t    tag;
 
 	// look it up
-	tag = (uintptr_t) CFDictionaryGetValue(state->tags, o);
+	tag = IOCFSerializeBinaryIsTaggedNumber(o) ? 0 : (uintptr_t) CFDictionaryGetValue(state->tags, o);
 	// does it exist?
 	if (tag)
 	{
@@ -926,7 +1159,8 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
 
     if (type == CFDictionaryGetTypeID())
 	{
-		count = CFDictionaryGetCount(o);
+		CFDictionaryRef snapshot = CFDictionaryCopySnapshot(o);
+		count = CFDictionaryGetCount(snapshot);
 		key = (kOSSerializeDictionary | count);
 		ok = IOCFSerializeBinaryAddObject(state, o, key, NULL, 0, 0);
 		if (ok)
@@ -934,9 +1168,10 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
 			applierState.ok    = true;
 			applierState.index = 0;
 			applierState.count = count;
-			CFDictionaryApplyFunction(o, &IOCFSerializeBinaryCFDictionaryFunction, &applierState);
+			CFDictionaryApplyFunction(snapshot, &IOCFSerializeBinaryCFDictionaryFunction, &applierState);
 			ok = applierState.ok;
 		}
+		CFRelease(snapshot);
 	}
     else if (type == CFArrayGetTypeID())
 	{
@@ -1160,6 +1395,7 @@ IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options __unused)
         CFRelease(state.data);
         state.data = NULL;  // it's returned
     }
+    if (state.data) CFDataShrinkToFit(state.data);
     if (state.tags) CFRelease(state.tags);
 
     return (state.data);
@@ -1193,11 +1429,50 @@ IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options __unused)
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+static CFTypeRef
+IOCFUnserializeBinaryOwned(const char * buffer, size_t bufferSize, CFTypeRef owner, CFAllocatorRef allocator,
+						   CFOptionFlags options, CFMutableSetRef strings, CFStringRef * errorString);
+
 CFTypeRef
 IOCFUnserializeBinary(const char	* buffer,
 					  size_t          bufferSize,
 					  CFAllocatorRef  allocator,
+					  CFOptionFlags	  options,
+					  CFStringRef	* errorString)
+{
+	return (IOCFUnserializeBinaryInterned(buffer, bufferSize, allocator, options, NULL, errorString));
+}
+
+CFTypeRef
+IOCFUnserializeBinaryInterned(const char	* buffer,
+					  size_t          bufferSize,
+					  CFAllocatorRef  allocator,
+					  CFOptionFlags	  options,
+					  CFMutableSetRef strings,
+					  CFStringRef	* errorString)
+{
+	return (IOCFUnserializeBinaryOwned(buffer, bufferSize, NULL, allocator, options, strings, errorString));
+}
+
+CFTypeRef
+IOCFUnserializeBinaryData(CFDataRef       data,
+					  CFAllocatorRef  allocator,
+					  CFOptionFlags	  options,
+					  CFMutableSetRef strings,
+					  CFStringRef	* errorString)
+{
+	return (IOCFUnserializeBinaryOwned((const char *) CFDataGetBytePtr(data), CFDataGetLength(data),
+									   data, allocator, options, strings, errorString));
+}
+
+/* data payloads borrow their bytes from owner, if there is one */
+static CFTypeRef
+IOCFUnserializeBinaryOwned(const char	* buffer,
+					  size_t          bufferSize,
+					  CFTypeRef       owner,
+					  CFAllocatorRef  allocator,
 					  CFOptionFlags	  options __unused,
+					  CFMutableSetRef strings,
 					  CFStringRef	* errorString)
 {
 	CFTypeRef * objsArray;
@@ -1333,7 +1608,10 @@ IOCFUnserializeBinary(const char	* buffer,
 				if (bufferPos > bufferSize) break;
 				if ((kOSSerializeSymbol == (kOSSerializeTypeMask & key))
 					&& (0 != ((const UInt8 *)next)[len])) break;
-				o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingUTF8, false);
+				if (strings)
+					o = CFStringCreateWithBytesInterned(strings, (const UInt8 *) next, len, kCFStringEncodingUTF8);
+				else
+					o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingUTF8, false);
 				if (!o)
 				{
 					o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingMacRoman, false);
@@ -1346,7 +1624,10 @@ IOCFUnserializeBinary(const char	* buffer,
     	    case kOSSerializeData:
 				bufferPos += (wordLen * sizeof(uint32_t));
 				if (bufferPos > bufferSize) break;
-				o = CFDataCreate(allocator, (const UInt8 *) next, len);
+				if (owner)
+					o = CFDataCreateWithBytesOwner(allocator, (const UInt8 *) next, len, owner);
+				else
+					o = CFDataCreate(allocator, (const UInt8 *) next, len);
 		        next += wordLen;
 		        break;
 
@@ -1421,6 +1702,9 @@ IOCFUnserializeBinary(const char	* buffer,
 
 		if (end)
 		{
+			/* duplicate keys and set members leave room behind */
+			if (dict)     CFDictionaryShrinkToFit(dict);
+			else if (set) CFSetShrinkToFit(set);
 			if (!stackIdx) break;
 			parent = stackArray[stackIdx];
 			DEBG("--stack[%d] %p\n", stackIdx, parent);
@@ -1464,6 +1748,17 @@ IOCFUnserializeWithSize(const char	  * buffer,
 						CFAllocatorRef	allocator,
 						CFOptionFlags	options,
 						CFStringRef	  * errorString)
+{
+	return (IOCFUnserializeWithSizeInterned(buffer, bufferSize, allocator, options, NULL, errorString));
+}
+
+CFTypeRef
+IOCFUnserializeWithSizeInterned(const char	  * buffer,
+						size_t          bufferSize,
+						CFAllocatorRef	allocator,
+						CFOptionFlags	options,
+						CFMutableSetRef	strings,
+						CFStringRef	  * errorString)
 {
  	if (errorString) *errorString = NULL;
 	if (!buffer) return 0;
@@ -1472,10 +1767,10 @@ IOCFUnserializeWithSize(const char	  * buffer,
     if (bufferSize < sizeof(kOSSerializeBinarySignature)) return (0);
 	if ((kIOCFSerializeToBinary & options)
 		|| (!strcmp(kOSSerializeBinarySignature, buffer))
-		|| (kOSSerializeIndexedBinarySignature == (((const uint8_t *) buffer)[0]))) return (IOCFUnserializeBinary(buffer, bufferSize, allocator, options, errorString));
+		|| (kOSSerializeIndexedBinarySignature == (((const uint8_t *) buffer)[0]))) return (IOCFUnserializeBinaryInterned(buffer, bufferSize, allocator, options, strings, errorString));
 #else
     if (!bufferSize) return (0);
 #endif /* IOKIT_SERVER_VERSION >= 20140421 */
 
-	return (IOCFUnserialize(buffer, allocator, options, errorString));
+	return (IOCFUnserializeInterned(buffer, allocator, options, strings, errorString));
 }
@@ -169,6 +169,7 @@
 #include <CoreFoundation/CFArray.h>
 #include <CoreFoundation/CFSet.h>
 #include <CoreFoundation/CFDictionary.h>
+#include <IOKit/IOCFUnserialize.h>
 
 #define YYSTYPE object_t *
 #define YYPARSE_PARAM	state
@@ -199,6 +200,7 @@ typedef struct parser_state {
 	object_t	*objects;		// internal objects in use
 	object_t	*freeObjects;		// internal objects that are free
 	CFMutableDictionaryRef tags;		// used to remember "ID" tags
+	CFMutableSetRef	strings;		// optional table to intern strings in
 	CFStringRef 	*errorString;		// parse error with line
 	CFTypeRef	parsedObject;		// resultant object of parsed text
 } parser_state_t;
@@ -2474,12 +2476,17 @@ retrieveObject(parser_state_t *state, intptr_t tag)
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 
+// elements are collected here so containers can be built in one go
+#define BUILD_STACK_COUNT	32
+
 object_t *
 buildDictionary(parser_state_t *state, object_t * header)
 {
 	object_t *o, *t;
-	int count = 0;
+	int count = 0, i;
 	CFMutableDictionaryRef dict;
+	const void *stackKeys[BUILD_STACK_COUNT], *stackValues[BUILD_STACK_COUNT];
+	const void **keys = stackKeys, **values = stackValues;
 
 	// get count and reverse order
 	o = header->elements;
@@ -2493,15 +2500,23 @@ buildDictionary(parser_state_t *state, object_t * header)
 		header->elements = t;
 	}
 
-        dict = CFDictionaryCreateMutable(state->allocator, count,
-					&kCFTypeDictionaryKeyCallBacks,
-					&kCFTypeDictionaryValueCallBacks);
+	if (count > BUILD_STACK_COUNT) {
+		keys = malloc(count * sizeof(*keys));
+		values = malloc(count * sizeof(*values));
+		if (!keys || !values) abort();
+	}
+	for (o = header->elements, i = 0; o; o = o->next, i++) {
+		keys[i] = o->key;
+		values[i] = o->object;
+	}
+
+	dict = CFDictionaryCreateMutableWithValues(state->allocator, keys, values, count,
+				  &kCFTypeDictionaryKeyCallBacks,
+				  &kCFTypeDictionaryValueCallBacks);
 	if (header->idref >= 0) rememberObject(state, header->idref, dict);
 
 	o = header->elements;
 	while (o) {
-		CFDictionarySetValue(dict, o->key, o->object);
-
 		CFRelease(o->key); 
 		CFRelease(o->object); 
 		o->key = 0;
@@ -2511,6 +2526,10 @@ buildDictionary(parser_state_t *state, object_t * header)
 		o = o->next;
 		freeObject(state, t);
 	}
+	if (keys != stackKeys) {
+		free(keys);
+		free(values);
+	}
 	o = header;
 	o->object = dict;
 	return o;
@@ -2520,8 +2539,10 @@ object_t *
 buildArray(parser_state_t *state, object_t * header)
 {
 	object_t *o, *t;
-	int count = 0;
+	int count = 0, i;
 	CFMutableArrayRef array;
+	const void *stackValues[BUILD_STACK_COUNT];
+	const void **values = stackValues;
 
 	// get count and reverse order
 	o = header->elements;
@@ -2535,13 +2556,19 @@ buildArray(parser_state_t *state, object_t * header)
 		header->elements = t;
 	}
 
-	array = CFArrayCreateMutable(state->allocator, count, &kCFTypeArrayCallBacks);
+	if (count > BUILD_STACK_COUNT) {
+		values = malloc(count * sizeof(*values));
+		if (!values) abort();
+	}
+	for (o = header->elements, i = 0; o; o = o->next, i++) {
+		values[i] = o->object;
+	}
+
+	array = CFArrayCreateMutableWithValues(state->allocator, values, count, &kCFTypeArrayCallBacks);
 	if (header->idref >= 0) rememberObject(state, header->idref, array);
 
 	o = header->elements;
 	while (o) {
-		CFArrayAppendValue(array, o->object);
-
 		CFRelease(o->object);
 		o->object = 0;
 
@@ -2549,6 +2576,7 @@ buildArray(parser_state_t *state, object_t * header)
 		o = o->next;
 		freeObject(state, t);
 	}
+	if (values != stackValues) free(values);
 	o = header;
 	o->object = array;
 	return o;
@@ -2558,8 +2586,10 @@ object_t *
 buildSet(parser_state_t *state, object_t *header)
 {
 	object_t *o, *t;
-	int count = 0;
+	int count = 0, i;
 	CFMutableSetRef set;
+	const void *stackValues[BUILD_STACK_COUNT];
+	const void **values = stackValues;
 
 	// get count and reverse order
 	o = header->elements;
@@ -2573,13 +2603,19 @@ buildSet(parser_state_t *state, object_t *header)
 		header->elements = t;
 	}
 
-	set = CFSetCreateMutable(state->allocator, count, &kCFTypeSetCallBacks);
+	if (count > BUILD_STACK_COUNT) {
+		values = malloc(count * sizeof(*values));
+		if (!values) abort();
+	}
+	for (o = header->elements, i = 0; o; o = o->next, i++) {
+		values[i] = o->object;
+	}
+
+	set = CFSetCreateMutableWithValues(state->allocator, values, count, &kCFTypeSetCallBacks);
 	if (header->idref >= 0) rememberObject(state, header->idref, set);
 
 	o = header->elements;
 	while (o) {
-		CFSetAddValue(set, o->object);
-
 		CFRelease(o->object);
 		o->object = 0;
 
@@ -2587,6 +2623,7 @@ buildSet(parser_state_t *state, object_t *header)
 		o = o->next;
 		freeObject(state, t);
 	}
+	if (values != stackValues) free(values);
 	o = header;
 	o->object = set;
 	return o;
@@ -2597,8 +2634,13 @@ buildString(parser_state_t *state, object_t *o)
 {
 	CFStringRef string;
 
-	string = CFStringCreateWithCString(state->allocator, o->string,
-					   kCFStringEncodingUTF8);
+	if (state->strings) {
+		string = CFStringCreateWithBytesInterned(state->strings, (const UInt8 *) o->string,
+						   strlen(o->string), kCFStringEncodingUTF8);
+	} else {
+		string = CFStringCreateWithCString(state->allocator, o->string,
+						   kCFStringEncodingUTF8);
+	}
 	if (!string) {
 	    syslog(LOG_ERR, "FIXME: IOUnserialize has detected a string that is not valid UTF-8, \"%s\".", o->string);
 	    string = CFStringCreateWithCString(state->allocator, o->string,
@@ -2666,6 +2708,16 @@ IOCFUnserialize(const char	*buffer,
                 CFAllocatorRef	allocator,
                 CFOptionFlags	options,
                 CFStringRef	*errorString)
+{
+	return IOCFUnserializeInterned(buffer, allocator, options, NULL, errorString);
+}
+
+CFTypeRef
+IOCFUnserializeInterned(const char	*buffer,
+                CFAllocatorRef	allocator,
+                CFOptionFlags	options,
+                CFMutableSetRef	strings,
+                CFStringRef	*errorString)
 {
 	CFTypeRef object;
 	parser_state_t *state;
@@ -2687,6 +2739,7 @@ IOCFUnserialize(const char	*buffer,
 	state->freeObjects = 0;
 	state->tags = CFDictionaryCreateMutable(allocator, 0, 0, /* key callbacks */
 						&kCFTypeDictionaryValueCallBacks);
+	state->strings = strings;
 	state->errorString = errorString;
 	state->parsedObject = 0;
 
@@ -0,0 +1,112 @@
+// Retired snapshots of concurrent dictionaries must not outlive the last write:
+// after a burst of writes, leaving a read section frees all but the current
+// snapshot, and releasing everything brings the live counts back to zero.
+// Built with CF_MEMORY_ACCOUNTING, see `make test`.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#define KEYS 64
+#define WRITES 2500
+#define READERS 4
+
+static CFMutableDictionaryRef Dict;
+static CFStringRef Keys[KEYS];
+static _Atomic int Stop;
+
+static int64_t Live(CFTypeID type)
+{
+    CFMemoryStatistics stats[kCFTypeAllocator + 1];
+    CFMemoryGetStatistics(stats, kCFTypeAllocator + 1);
+    return stats[type].objects;
+}
+
+static int64_t LiveBytes(void)
+{
+    CFMemoryStatistics stats[kCFTypeAllocator + 1];
+    CFIndex count = CFMemoryGetStatistics(stats, kCFTypeAllocator + 1);
+    int64_t bytes = 0;
+    for(CFIndex type = 0; type < count && type <= kCFTypeAllocator; ++type)
+        bytes += stats[type].headerBytes + stats[type].payloadBytes;
+    return bytes;
+}
+
+static void* Reader(void *arg)
+{
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    while(!__c11_atomic_load(&Stop, __ATOMIC_RELAXED))
+    {
+        seed = seed * 1103515245 + 12345;
+        CFDictionaryGetValue(Dict, Keys[(seed >> 8) % KEYS]);
+    }
+    return NULL;
+}
+
+static void Burst(void)
+{
+    char buf[64];
+    for(int n = 0; n < WRITES; ++n)
+    {
+        snprintf(buf, sizeof(buf), "a value long enough to get its own buffer %d", n);
+        CFStringRef value = CFStringCreateWithCString(NULL, buf, kCFStringEncodingUTF8);
+        CFDictionarySetValue(Dict, Keys[n % KEYS], value);
+        CFRelease(value);
+    }
+}
+
+static int Check(const char *what, int64_t got, int64_t expected)
+{
+    if(got == expected)
+        return 0;
+    fprintf(stderr, "%s: %lld, expected %lld\n", what, (long long)got, (long long)expected);
+    return 1;
+}
+
+int main(void)
+{
+    int failures = 0;
+    char name[32];
+    for(int i = 0; i < KEYS; ++i)
+    {
+        snprintf(name, sizeof(name), "IORegistryKey%d", i);
+        Keys[i] = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    }
+
+    // Writes alone, then a single read.
+    Dict = CFDictionaryCreateMutable(NULL, KEYS, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryMakeConcurrent(Dict);
+    Burst();
+    CFDictionaryGetValue(Dict, Keys[0]);
+    failures += Check("dictionaries after the last read", Live(kCFTypeDictionary), 2);
+    failures += Check("strings after the last read", Live(kCFTypeString), KEYS + KEYS);
+    CFRelease(Dict);
+    failures += Check("dictionaries after release", Live(kCFTypeDictionary), 0);
+
+    // Writes racing with readers, then nothing until the dictionary goes away.
+    Dict = CFDictionaryCreateMutable(NULL, KEYS, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryMakeConcurrent(Dict);
+    pthread_t readers[READERS];
+    __c11_atomic_store(&Stop, 0, __ATOMIC_RELAXED);
+    for(int i = 0; i < READERS; ++i)
+        pthread_create(&readers[i], NULL, Reader, (void*)(uintptr_t)i);
+    Burst();
+    __c11_atomic_store(&Stop, 1, __ATOMIC_RELAXED);
+    for(int i = 0; i < READERS; ++i)
+        pthread_join(readers[i], NULL);
+    CFRelease(Dict);
+
+    for(int i = 0; i < KEYS; ++i)
+        CFRelease(Keys[i]);
+    for(CFTypeID type = 0; type <= kCFTypeAllocator; ++type)
+    {
+        snprintf(name, sizeof(name), "live objects of type %d", (int)type);
+        failures += Check(name, Live(type), 0);
+    }
+    failures += Check("live bytes", LiveBytes(), 0);
+
+    if(!failures)
+        printf("epoch_reclaim: ok\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+// Pins how repeated numbers are serialized. Small integers are tagged pointers with
+// no identity of their own, so they are written out in full each time; numbers that
+// don't fit a tag are still objects, and get an ID or a back-reference when shared.
+#include <stdio.h>
+#include <string.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOCFSerialize.h>
+
+static const char ExpectedXML[] =
+    "<array>"
+    "<integer size=\"64\">0x7</integer>"
+    "<integer size=\"64\">0x7</integer>"
+    "<integer ID=\"0\" size=\"64\">0x1000000000000000</integer>"
+    "<integer IDREF=\"0\"/>"
+    "<string ID=\"1\">shared</string>"
+    "<string IDREF=\"1\"/>"
+    "</array>";
+
+static const char ExpectedBinary[] =
+    "d3000000"                          // signature
+    "06000082"                          // array of 6
+    "40000004" "0700000000000000"       // 0x7
+    "40000004" "0700000000000000"       // 0x7 again, in full
+    "40000004" "0000000000000010"       // 1 << 60, object 3
+    "0300000c"                          // reference to object 3
+    "06000009" "7368617265640000"       // "shared", object 4
+    "0400008c";                         // reference to object 4, ends the array
+
+static int CheckRoundTrip(const char *what, CFDataRef data, CFTypeRef expected, Boolean binary)
+{
+    CFStringRef error = NULL;
+    CFTypeRef decoded = binary
+        ? IOCFUnserializeBinary((const char*)CFDataGetBytePtr(data), CFDataGetLength(data), NULL, 0, &error)
+        : IOCFUnserializeWithSize((const char*)CFDataGetBytePtr(data), CFDataGetLength(data), NULL, 0, &error);
+    Boolean ok = decoded && CFEqual(decoded, expected);
+    if(decoded)
+        CFRelease(decoded);
+    if(error)
+        CFRelease(error);
+    if(ok)
+        return 0;
+    fprintf(stderr, "%s: does not decode to the original\n", what);
+    return 1;
+}
+
+int main(void)
+{
+    int failures = 0;
+    int small = 7;
+    long long large = 1LL << 60;
+    CFNumberRef smallNumber = CFNumberCreate(NULL, kCFNumberIntType, &small);
+    CFNumberRef largeNumber = CFNumberCreate(NULL, kCFNumberLongLongType, &large);
+    CFStringRef string = CFStringCreateWithCString(NULL, "shared", kCFStringEncodingUTF8);
+    const void *values[] = { smallNumber, smallNumber, largeNumber, largeNumber, string, string };
+    CFArrayRef array = CFArrayCreate(NULL, values, 6, &kCFTypeArrayCallBacks);
+
+    CFDataRef xml = IOCFSerialize(array, 0);
+    if(!xml || strcmp((const char*)CFDataGetBytePtr(xml), ExpectedXML))
+    {
+        fprintf(stderr, "xml: %s\nexpected: %s\n", xml ? (const char*)CFDataGetBytePtr(xml) : "(null)", ExpectedXML);
+        ++failures;
+    }
+    else
+    {
+        failures += CheckRoundTrip("xml", xml, array, false);
+    }
+
+    CFDataRef binary = IOCFSerialize(array, kIOCFSerializeToBinary);
+    char hex[sizeof(ExpectedBinary) * 2];
+    CFIndex length = binary ? CFDataGetLength(binary) : 0;
+    for(CFIndex i = 0; i < length && 2 * i + 2 < (CFIndex)sizeof(hex); ++i)
+        snprintf(hex + 2 * i, 3, "%02x", CFDataGetBytePtr(binary)[i]);
+    if(!binary || 2 * length != (CFIndex)strlen(ExpectedBinary) || strcmp(hex, ExpectedBinary))
+    {
+        fprintf(stderr, "binary: %ld bytes, expected %ld\n", (long)length, (long)strlen(ExpectedBinary) / 2);
+        ++failures;
+    }
+    else
+    {
+        failures += CheckRoundTrip("binary", binary, array, true);
+    }
+
+    if(xml)
+        CFRelease(xml);
+    if(binary)
+        CFRelease(binary);
+    CFRelease(array);
+    CFRelease(string);
+    CFRelease(largeNumber);
+    CFRelease(smallNumber);
+
+    if(!failures)
+        printf("serialize_numbers: ok\n");
+    return failures ? 1 : 0;
+}